@@ -0,0 +1,81 @@
+#pragma once
+
+#include "smtp_client.hpp"
+
+#include <chrono>
+#include <map>
+#include <sdbusplus/asio/connection.hpp>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace mail
+{
+namespace alert
+{
+namespace manager
+{
+
+static constexpr const char* resolvedService = "org.freedesktop.resolve1";
+static constexpr const char* resolvedObj = "/org/freedesktop/resolve1";
+static constexpr const char* resolvedIntf = "org.freedesktop.resolve1.Manager";
+
+/* resolved does not report record TTLs over D-Bus, so they are configured */
+static constexpr auto defaultDnsCacheTtl = std::chrono::seconds(300);
+static constexpr auto defaultDnsStaleWindow = std::chrono::seconds(3600);
+
+/**
+ * DnsResolver - Host name lookup through systemd-resolved on D-Bus, which
+ * keeps SMTP sessions from blocking in getaddrinfo().
+ *
+ * Answers are cached for ttl. An expired answer is still handed out right
+ * away while a refresh runs in the background, so a slow or unreachable
+ * DNS server does not delay alerts. When refreshes keep failing the last
+ * good answer is used until staleWindow after it expired. Concurrent
+ * lookups of the same host share one query.
+ */
+class DnsResolver
+{
+  public:
+    using Address = std::tuple<int32_t, int32_t, std::vector<uint8_t>>;
+
+    explicit DnsResolver(std::shared_ptr<sdbusplus::asio::connection> conn) :
+        conn(conn)
+    {}
+
+    void configure(std::chrono::seconds ttl, std::chrono::seconds staleWindow)
+    {
+        this->ttl = ttl;
+        this->staleWindow = staleWindow;
+    }
+
+    void resolve(const std::string& host, uint16_t port,
+                 SmtpClient::ResolveHandler handler);
+
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Entry
+    {
+        std::vector<boost::asio::ip::address> addresses;
+        Clock::time_point expires;
+        bool refreshing = false;
+        std::vector<std::pair<uint16_t, SmtpClient::ResolveHandler>> waiters;
+    };
+
+    void query(const std::string& host);
+    void answer(const std::string& host, const boost::system::error_code& ec,
+                const std::vector<Address>& records);
+    static SmtpClient::Endpoints
+        endpoints(const std::vector<boost::asio::ip::address>& addresses,
+                  uint16_t port);
+
+    std::shared_ptr<sdbusplus::asio::connection> conn;
+    std::map<std::string, Entry> cache;
+    std::chrono::seconds ttl = defaultDnsCacheTtl;
+    std::chrono::seconds staleWindow = defaultDnsStaleWindow;
+};
+
+} // namespace manager
+} // namespace alert
+} // namespace mail
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "mail_alert_manager.hpp"
+
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace mail
+{
+namespace alert
+{
+namespace manager
+{
+
+/**
+ * LibesmtpWorker - Runs the blocking libesmtp engine on a thread of its
+ * own so a slow relay cannot stall the io_service. Messages are sent one
+ * at a time in submission order; libesmtp and the scratch buffers of Smtp
+ * are only touched by the worker thread.
+ *
+ * The daemon's asio is built without thread support, so the worker never
+ * calls into it: finished sends are handed back through an eventfd and
+ * their callbacks run on the io_service.
+ */
+class LibesmtpWorker
+{
+  public:
+    LibesmtpWorker(boost::asio::io_service& io, Smtp& smtp);
+    ~LibesmtpWorker();
+
+    LibesmtpWorker(const LibesmtpWorker&) = delete;
+    LibesmtpWorker& operator=(const LibesmtpWorker&) = delete;
+
+    /* relay is a snapshot, configuration changes do not race the send */
+    void send(const SmtpRelay& relay, SmtpMessage&& message,
+              SmtpClient::Callback callback);
+
+    /* send() for any asio completion token, see SmtpClient::asyncSend */
+    template <typename CompletionToken>
+    auto asyncSend(const SmtpRelay& relay, SmtpMessage&& message,
+                   CompletionToken&& token)
+    {
+        return boost::asio::async_initiate<CompletionToken,
+                                           void(SmtpResult)>(
+            [this, &relay](auto handler, SmtpMessage&& message) {
+                auto shared = std::make_shared<decltype(handler)>(
+                    std::move(handler));
+                send(relay, std::move(message),
+                     [shared](const SmtpResult& result) {
+                         (*shared)(result);
+                     });
+            },
+            token, std::move(message));
+    }
+
+  private:
+    struct Request
+    {
+        SmtpRelay relay;
+        SmtpMessage message;
+        SmtpClient::Callback callback;
+        SmtpResult result;
+    };
+
+    void run();
+    void watch();
+    void complete();
+
+    boost::asio::io_service& io;
+    Smtp& smtp;
+    int eventFd = -1;
+    boost::asio::posix::stream_descriptor notifier;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<Request> pending;
+    std::deque<Request> finished;
+    bool stopping = false;
+    std::thread thread;
+};
+
+} // namespace manager
+} // namespace alert
+} // namespace mail
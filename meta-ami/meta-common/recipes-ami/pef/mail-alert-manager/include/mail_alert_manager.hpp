@@ -2,6 +2,12 @@
 
 #define _XOPEN_SOURCE 500
 
+#include "dns_resolver.hpp"
+#include "mail_digest.hpp"
+#include "mail_queue.hpp"
+#include "mail_spool.hpp"
+#include "relay_balancer.hpp"
+
 #include <auth-client.h>
 #include <ctype.h>
 #include <errno.h>
@@ -41,14 +47,43 @@ class Smtp
     uint16_t port = 0;
     std::string sender;
     bool enable = false;
+    std::string username;
+    std::string password;
+    StartTls startTls = StartTls::enabled;
+    /* Shared SSL_CTX handed to libesmtp for STARTTLS */
+    SSL_CTX* tlsContext = nullptr;
+    /* The blocking libesmtp engine is kept as a fallback */
+    bool useLibesmtp = false;
+    size_t queueCapacity = defaultMailQueueCapacity;
+    size_t workers = defaultMailWorkers;
+    /* Ordered relay list, Host and Port mirror the first entry */
+    std::vector<RelayEndpoint> relays;
+    RelayPolicy relayPolicy = RelayPolicy::failover;
+    std::chrono::seconds dnsCacheTtl = defaultDnsCacheTtl;
+    std::chrono::seconds dnsStaleWindow = defaultDnsStaleWindow;
+    std::chrono::seconds digestWindow = defaultMailDigestWindow;
+    size_t spoolMaxBytes = defaultMailSpoolMaxBytes;
+    SpoolEviction spoolEviction = SpoolEviction::dropOldest;
     enum notify_flags notify = Notify_NOTSET;
+    /* Scratch buffers of the libesmtp engine, reused across sends */
+    std::string toHeader;
+    std::string server;
 
-    uint16_t sendmail(const std::string& recipient, const std::string& subject,
-                      const std::string& msg);
+    /* Blocking libesmtp send, only called on the LibesmtpWorker thread */
+    std::tuple<uint16_t, std::vector<uint16_t>>
+        sendmailMulti(const SmtpRelay& relay,
+                      const std::vector<std::string>& recipients,
+                      const std::string& subject, const std::string& msg);
     std::tuple<bool, std::string, uint16_t, std::string> getsmtpconfig();
     uint16_t setsmtpconfig(const bool enable, const std::string& host,
                            const uint16_t& port, const std::string& sender);
+    std::vector<std::tuple<std::string, uint16_t, uint16_t>> getRelays();
+    uint16_t setRelays(
+        const std::vector<std::tuple<std::string, uint16_t, uint16_t>>& list,
+        const std::string& policy);
     int initializeSmtpcfg();
+    bool isConfigured() const;
+    SmtpRelay relay() const;
 };
 
 } // namespace manager
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "mail_queue.hpp"
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace mail
+{
+namespace alert
+{
+namespace manager
+{
+
+/* Digest mode is off unless DigestWindow is set */
+static constexpr auto defaultMailDigestWindow = std::chrono::seconds(0);
+/* A digest is sent early once it holds this many events */
+static constexpr size_t mailDigestMaxEvents = 100;
+
+/**
+ * MailDigest - Optional digest stage in front of the MailQueue. Messages to
+ * the same recipients arriving within the digest window are merged into a
+ * single mail with one table row per event. The first message opens the
+ * digest and reserves its job ID; later ones get the same ID back, and
+ * MailDelivered reports the digest as a whole. A message whose body carries
+ * a "Severity : Critical" line, as PEF alerts do, sends the open digest
+ * right away together with the critical event.
+ *
+ * The job ID is returned before the digest is sent, so every event is
+ * held in the spool as it arrives and the mail is only composed when the
+ * digest is sent. After a restart the events held so far go out as one
+ * mail, see restore.
+ */
+class MailDigest
+{
+  public:
+    MailDigest(boost::asio::io_service& io, MailQueue& queue) :
+        io(io), queue(queue)
+    {}
+
+    void configure(std::chrono::seconds window)
+    {
+        this->window = window;
+    }
+
+    /**
+     * submit - Queue or merge a message. Returns its job ID, or 0 when it
+     * went straight to a full queue.
+     */
+    uint64_t submit(SmtpMessage&& message);
+
+    /**
+     * restore - Send the digests whose events were held in the spool when
+     * the daemon stopped. events come sorted by job ID and part.
+     */
+    void restore(std::vector<HeldEvent>&& events);
+
+  private:
+    struct Event
+    {
+        std::chrono::system_clock::time_point received;
+        std::string subject;
+        std::string body;
+    };
+
+    struct Digest
+    {
+        uint64_t jobId = 0;
+        std::vector<std::string> recipients;
+        std::vector<Event> events;
+        std::unique_ptr<boost::asio::steady_timer> timer;
+    };
+
+    void flush(const std::string& key);
+    static bool isCritical(const std::string& body);
+    static SmtpMessage compose(const Digest& digest);
+
+    boost::asio::io_service& io;
+    MailQueue& queue;
+    std::chrono::seconds window = defaultMailDigestWindow;
+    std::map<std::string, Digest> digests;
+};
+
+} // namespace manager
+} // namespace alert
+} // namespace mail
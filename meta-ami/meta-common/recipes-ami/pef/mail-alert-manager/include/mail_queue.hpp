@@ -0,0 +1,148 @@
+#pragma once
+
+#include "smtp_client.hpp"
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace mail
+{
+namespace alert
+{
+namespace manager
+{
+
+static constexpr size_t defaultMailQueueCapacity = 256;
+static constexpr size_t defaultMailWorkers = 2;
+
+/* MailDelivered status of a job evicted from a full spool */
+static constexpr uint16_t smtpStatusEvicted = 3;
+
+/**
+ * SpoolEviction - What submit does when the spool would grow past its size
+ * cap: drop the oldest queued jobs to make room, or refuse the new one.
+ */
+enum class SpoolEviction
+{
+    dropOldest,
+    rejectNew,
+};
+
+class MailSpool;
+
+struct MailJob
+{
+    uint64_t id = 0;
+    SmtpMessage message;
+    std::chrono::steady_clock::time_point queued;
+};
+
+/**
+ * HeldEvent - One event of a digest that is still collecting, spooled on
+ * its own under the job ID reserved for the digest. part is its position
+ * in the digest.
+ */
+struct HeldEvent
+{
+    uint64_t id = 0;
+    uint32_t part = 0;
+    SmtpMessage message;
+    std::chrono::system_clock::time_point received;
+};
+
+/**
+ * MailQueueStatus - queued, inFlight, capacity, delivered, failed and
+ * rejected (refused because the queue was full) as returned by
+ * GetQueueStatus.
+ */
+using MailQueueStatus =
+    std::tuple<uint32_t, uint32_t, uint32_t, uint64_t, uint64_t, uint64_t>;
+
+/**
+ * MailQueue - Bounded in-memory queue behind SendMailAsync. Producers get a
+ * job ID back right away; up to workers jobs are handed to the sender at
+ * once and the rest wait in FIFO order. Every finished job is reported
+ * with its status and the latency from submission to completion.
+ *
+ * With a spool attached every accepted job is also written to disk and
+ * removed from it once finished, so a restart picks up where it left off.
+ */
+class MailQueue
+{
+  public:
+    using Sender = std::function<void(SmtpMessage&&, SmtpClient::Callback)>;
+    using DoneHandler =
+        std::function<void(uint64_t jobId, uint16_t status,
+                           uint32_t latencyMs)>;
+
+    MailQueue(Sender sender, DoneHandler onDone);
+
+    void configure(size_t capacity, size_t workers);
+
+    /**
+     * attachSpool - Persist jobs to spool, capped at maxBytes of pending
+     * records, and requeue the jobs it still holds from a previous run.
+     */
+    void attachSpool(MailSpool& spool, size_t maxBytes,
+                     SpoolEviction eviction);
+
+    /**
+     * submit - Queue a message. Returns its job ID, or 0 when the queue is
+     * full and the message was not accepted.
+     */
+    uint64_t submit(SmtpMessage&& message);
+
+    /**
+     * reserveId - Hand out a job ID now for a message submitted later with
+     * submitReserved, e.g. one still being merged into a digest. With a
+     * spool attached IDs are unique across restarts.
+     */
+    uint64_t reserveId();
+
+    /**
+     * submitReserved - Queue a message under a reserved ID. The producer
+     * already holds the ID, so a refusal is reported through the done
+     * handler with smtpStatusEvicted.
+     */
+    void submitReserved(SmtpMessage&& message, uint64_t id);
+
+    /**
+     * hold - Spool one event of a digest under its reserved ID before the
+     * digest is submitted. The message submitted later under that ID
+     * replaces all of them. Returns false when it could not be spooled.
+     */
+    bool hold(const HeldEvent& event);
+
+    MailQueueStatus status() const;
+
+  private:
+    void drain();
+    bool reserve(size_t bytes, size_t replaced = 0);
+    bool enqueue(SmtpMessage&& message, uint64_t id);
+    void complete(uint64_t jobId, std::chrono::steady_clock::time_point queued,
+                  const SmtpResult& result);
+
+    Sender sender;
+    DoneHandler onDone;
+    MailSpool* spool = nullptr;
+    size_t spoolMaxBytes = 0;
+    SpoolEviction eviction = SpoolEviction::dropOldest;
+    std::deque<MailJob> jobs;
+    size_t capacity = defaultMailQueueCapacity;
+    size_t workers = defaultMailWorkers;
+    size_t inFlight = 0;
+    uint64_t nextId = 1;
+    /* First ID not yet claimed in the spool */
+    uint64_t idLimit = 1;
+    uint64_t delivered = 0;
+    uint64_t failed = 0;
+    uint64_t rejected = 0;
+};
+
+} // namespace manager
+} // namespace alert
+} // namespace mail
@@ -0,0 +1,141 @@
+#pragma once
+
+#include "mail_queue.hpp"
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <chrono>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace mail
+{
+namespace alert
+{
+namespace manager
+{
+
+static constexpr const char* mailSpoolDir = "/var/lib/alert/spool";
+static constexpr size_t mailSpoolSegmentSize = 64 * 1024;
+static constexpr size_t defaultMailSpoolMaxBytes = 1024 * 1024;
+static constexpr uint32_t mailSpoolSyncBatch = 16;
+static constexpr auto mailSpoolSyncInterval = std::chrono::seconds(1);
+/* Job IDs are claimed on disk this many at a time */
+static constexpr uint64_t mailSpoolIdBlock = 1024;
+
+/**
+ * MailSpool - Crash-safe on-disk copy of the queued mail. Jobs are appended
+ * as length-prefixed, CRC protected records to segment files of
+ * mailSpoolSegmentSize bytes. A delivered job is marked done in place; a
+ * sealed segment is deleted once all of its records are done and
+ * compacted (its pending records copied to the active segment) once less
+ * than half of it is still pending. fdatasync is batched: the dirty
+ * segments are flushed after mailSpoolSyncBatch updates or
+ * mailSpoolSyncInterval, whichever comes first.
+ *
+ * A digest that is still collecting has one small record per event under
+ * its job ID. The job record written when the digest is submitted
+ * supersedes them, so the events are never rewritten as they arrive.
+ */
+class MailSpool
+{
+  public:
+    MailSpool(boost::asio::io_service& io, const std::string& dir);
+    ~MailSpool();
+
+    MailSpool(const MailSpool&) = delete;
+    MailSpool& operator=(const MailSpool&) = delete;
+
+    /**
+     * load - Open the spool and return the pending jobs in submission
+     * order. A torn record at the end of a segment is cut off, a damaged
+     * one inside it is skipped. Held digest events are kept for takeHeld.
+     */
+    std::vector<MailJob> load();
+
+    /* Held digest events found by load(), by job ID and part */
+    std::vector<HeldEvent> takeHeld()
+    {
+        return std::move(held);
+    }
+
+    /* Write a job; any record spooled under its ID is replaced */
+    bool append(const MailJob& job);
+    /* Write one event of a digest that is not submitted yet */
+    bool hold(const HeldEvent& event);
+    void remove(uint64_t jobId);
+
+    /**
+     * reserveIds - Record on disk that job IDs below from + count may be
+     * in use, so a restart never hands them out again. Returns the new
+     * limit.
+     */
+    uint64_t reserveIds(uint64_t from, uint64_t count);
+
+    /* First job ID not claimed by a previous run, valid after load() */
+    uint64_t idLimit() const
+    {
+        return claimedIds;
+    }
+
+    /* Bytes taken by pending records */
+    size_t pendingBytes() const
+    {
+        return liveTotal;
+    }
+
+    /* Bytes taken by the pending records of one job */
+    size_t pendingBytes(uint64_t jobId) const;
+
+    static size_t recordSize(const SmtpMessage& message, bool held = false);
+
+    void sync();
+
+  private:
+    struct Segment
+    {
+        int fd = -1;
+        size_t size = 0;
+        size_t live = 0;
+        size_t liveBytes = 0;
+    };
+
+    struct Location
+    {
+        uint32_t segment;
+        size_t offset;
+        size_t length;
+    };
+
+    bool openSegment(uint32_t seq, bool create);
+    bool writeRecord(const std::string& record, uint64_t jobId,
+                     std::vector<Location>* superseded = nullptr);
+    void unindex(uint64_t jobId, const Location& loc);
+    void release(const std::vector<Location>& locs);
+    void markDone(const Location& loc);
+    void seal(uint32_t seq);
+    void compact(uint32_t seq);
+    bool moveRecords(uint32_t seq);
+    void dropSegment(uint32_t seq);
+    void scheduleSync(uint32_t seq);
+    std::string segmentPath(uint32_t seq) const;
+
+    boost::asio::steady_timer syncTimer;
+    std::string dir;
+    std::map<uint32_t, Segment> segments;
+    std::multimap<uint64_t, Location> index;
+    std::vector<HeldEvent> held;
+    std::set<uint32_t> dirtySegments;
+    uint32_t active = 0;
+    size_t liveTotal = 0;
+    uint32_t dirty = 0;
+    bool syncArmed = false;
+    bool compacting = false;
+    uint64_t claimedIds = 1;
+};
+
+} // namespace manager
+} // namespace alert
+} // namespace mail
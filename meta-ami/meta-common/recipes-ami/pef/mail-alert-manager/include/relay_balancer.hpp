@@ -0,0 +1,126 @@
+#pragma once
+
+#include "smtp_client.hpp"
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace mail
+{
+namespace alert
+{
+namespace manager
+{
+
+/* Consecutive failures after which a relay is put into cool-down */
+static constexpr uint32_t relayFailureThreshold = 3;
+static constexpr auto relayCooldown = std::chrono::seconds(60);
+
+struct RelayEndpoint
+{
+    std::string host;
+    uint16_t port = 0;
+    uint16_t weight = 1;
+};
+
+/**
+ * RelayPolicy - Which relay a delivery tries first: always the first
+ * healthy one in configured order, or the healthy relays in turn in
+ * proportion to their weights.
+ */
+enum class RelayPolicy
+{
+    failover,
+    weightedRoundRobin,
+};
+
+/**
+ * RelayHealth - host, port, healthy and consecutive failures of every
+ * relay, as returned by GetRelayHealth.
+ */
+using RelayHealth =
+    std::vector<std::tuple<std::string, uint16_t, bool, uint32_t>>;
+
+/**
+ * RelayBalancer - Spreads deliveries over the configured relays with
+ * passive health tracking. A delivery that fails at the transport level
+ * (connect, TLS, timeout or a 421 from the relay) moves on to the next
+ * relay; relayFailureThreshold such failures in a row put a relay into
+ * cool-down for relayCooldown, during which deliveries skip it. Relays in
+ * cool-down are still tried last, so mail keeps flowing when all of them
+ * are down. Message-level rejections do not count against a relay.
+ */
+class RelayBalancer
+{
+  public:
+    explicit RelayBalancer(SmtpClient& client) : client(client)
+    {}
+
+    /**
+     * configure - Replace the relay list. Relays that stay in the list keep
+     * their health state.
+     */
+    void configure(const std::vector<RelayEndpoint>& endpoints,
+                   RelayPolicy policy);
+
+    /**
+     * send - Deliver with the credentials and TLS settings of base to the
+     * relays in the order chosen by the policy.
+     */
+    void send(const SmtpRelay& base, SmtpMessage&& message,
+              SmtpClient::Callback callback);
+
+    template <typename CompletionToken>
+    auto asyncSend(const SmtpRelay& base, SmtpMessage&& message,
+                   CompletionToken&& token)
+    {
+        return boost::asio::async_initiate<CompletionToken,
+                                           void(SmtpResult)>(
+            [this, &base](auto handler, SmtpMessage&& message) {
+                auto shared = std::make_shared<decltype(handler)>(
+                    std::move(handler));
+                send(base, std::move(message),
+                     [shared](const SmtpResult& result) {
+                         (*shared)(result);
+                     });
+            },
+            token, std::move(message));
+    }
+
+    RelayHealth health() const;
+
+  private:
+    struct Relay
+    {
+        RelayEndpoint endpoint;
+        uint32_t failures = 0;
+        std::chrono::steady_clock::time_point coolUntil;
+        /* Running weight of the smooth weighted round-robin */
+        int64_t current = 0;
+    };
+
+    struct Attempt
+    {
+        SmtpRelay relay;
+        std::shared_ptr<const SmtpMessage> message;
+        SmtpClient::Callback callback;
+        std::vector<RelayEndpoint> order;
+        size_t next = 0;
+    };
+
+    std::vector<RelayEndpoint> candidates();
+    void attempt(const std::shared_ptr<Attempt>& state);
+    Relay* find(const RelayEndpoint& endpoint);
+    bool report(const RelayEndpoint& endpoint, const SmtpResult& result);
+
+    SmtpClient& client;
+    std::vector<Relay> relays;
+    RelayPolicy policy = RelayPolicy::failover;
+};
+
+} // namespace manager
+} // namespace alert
+} // namespace mail
@@ -0,0 +1,211 @@
+#pragma once
+
+#include "tls_context.hpp"
+
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace mail
+{
+namespace alert
+{
+namespace manager
+{
+
+/* Phase timeouts of one SMTP session */
+static constexpr auto smtpConnectTimeout = std::chrono::seconds(10);
+static constexpr auto smtpReplyTimeout = std::chrono::seconds(30);
+static constexpr auto smtpDataTimeout = std::chrono::seconds(60);
+
+/* Connection pool limits per relay */
+static constexpr size_t defaultSmtpPoolConnections = 2;
+static constexpr auto smtpPoolIdleTimeout = std::chrono::seconds(30);
+static constexpr uint32_t smtpPoolMaxMessages = 100;
+
+/* Status of a session that ended without a negative SMTP reply */
+static constexpr uint16_t smtpStatusOk = 0;
+static constexpr uint16_t smtpStatusTransportError = 1;
+static constexpr uint16_t smtpStatusTimeout = 2;
+/* Status of a send refused because no relay or sender is configured */
+static constexpr uint16_t smtpStatusNotConfigured = 4;
+/* RCPT status of an address refused before it reaches a relay, the reply
+ * a relay gives for a mailbox name that is not allowed */
+static constexpr uint16_t smtpStatusBadAddress = 553;
+
+enum class StartTls
+{
+    disabled,
+    enabled,
+    required,
+};
+
+/**
+ * SmtpRelay - Where and how a message is submitted. AUTH is only attempted
+ * when a user name is configured, and only over TLS to a relay whose
+ * certificate passed verification.
+ */
+struct SmtpRelay
+{
+    std::string host;
+    uint16_t port = 0;
+    std::string sender;
+    std::string username;
+    std::string password;
+    StartTls startTls = StartTls::enabled;
+};
+
+struct SmtpMessage
+{
+    std::vector<std::string> recipients;
+    std::string subject;
+    std::string body;
+};
+
+/**
+ * SmtpResult - Outcome of a session. status is smtpStatusOk when the relay
+ * accepted the message for at least one recipient, otherwise the failing
+ * SMTP reply code or one of the transport status values. rcptStatus holds
+ * the RCPT TO reply code of every recipient in message order.
+ */
+struct SmtpResult
+{
+    uint16_t status = smtpStatusTransportError;
+    std::vector<uint16_t> rcptStatus;
+};
+
+/**
+ * toHeader - The To field of a message. Recipients of a shared
+ * transaction must not see each other, so a message to more than one
+ * address names an empty group and the addresses only go in RCPT TO.
+ */
+std::string toHeader(const std::vector<std::string>& recipients);
+
+/**
+ * headerValue - A header field body on one line. CR and LF are dropped so
+ * a value cannot end the field and start headers of its own.
+ */
+std::string headerValue(const std::string& value);
+
+/**
+ * validAddress - Whether an address can go in MAIL FROM, RCPT TO and a
+ * header. CR or LF would end the command or field early, < or > would
+ * close the path and leave the rest to be read as parameters.
+ */
+bool validAddress(const std::string& address);
+
+class SmtpConnection;
+
+/**
+ * SmtpClient - Asynchronous SMTP engine on boost::asio. Deliveries run as
+ * state machines (connect, EHLO, STARTTLS, AUTH, MAIL, RCPT, DATA) with a
+ * timeout per phase, so many of them progress at once on the daemon's
+ * single io_service without blocking the D-Bus handlers.
+ *
+ * Authenticated connections are pooled per relay: up to maxConnections
+ * (the configured worker count) are open at once, further deliveries wait
+ * for one to become idle. Idle connections are reused with RSET and closed
+ * after smtpPoolIdleTimeout or smtpPoolMaxMessages transactions. A delivery
+ * whose pooled connection turns out to be dropped by the relay is resent
+ * once on a fresh connection.
+ *
+ * STARTTLS sessions come from the shared TlsContext and resume the last
+ * session of their relay. The certificate is verified against the CA
+ * store and the relay host name; with StartTLS "Required" a failure
+ * aborts the session, with "Enabled" it is logged and tolerated as long as
+ * no credentials would be sent.
+ */
+class SmtpClient
+{
+  public:
+    using Callback = std::function<void(const SmtpResult&)>;
+    using Endpoints = std::vector<boost::asio::ip::tcp::endpoint>;
+    using ResolveHandler =
+        std::function<void(const boost::system::error_code&, Endpoints&&)>;
+    using Resolver = std::function<void(const std::string& host,
+                                        uint16_t port, ResolveHandler)>;
+
+    SmtpClient(boost::asio::io_service& io, TlsContext& tls);
+
+    /**
+     * setResolver - Install the asynchronous host name lookup. asio's own
+     * resolver needs a thread, which the daemon is built without; without
+     * a resolver only IP address relays can be used.
+     */
+    void setResolver(Resolver resolver)
+    {
+        this->resolver = std::move(resolver);
+    }
+
+    void setMaxConnections(size_t value)
+    {
+        maxConnections = (value == 0) ? defaultSmtpPoolConnections : value;
+    }
+
+    void send(const SmtpRelay& relay, SmtpMessage&& message,
+              Callback callback);
+
+    /* send() for a message that may be handed to more than one relay */
+    void send(const SmtpRelay& relay,
+              std::shared_ptr<const SmtpMessage> message, Callback callback);
+
+    /**
+     * asyncSend - send() for any asio completion token, e.g. the
+     * yield_context of an sdbusplus method.
+     */
+    template <typename CompletionToken>
+    auto asyncSend(const SmtpRelay& relay, SmtpMessage&& message,
+                   CompletionToken&& token)
+    {
+        return boost::asio::async_initiate<CompletionToken,
+                                           void(SmtpResult)>(
+            [this, &relay](auto handler, SmtpMessage&& message) {
+                auto shared = std::make_shared<decltype(handler)>(
+                    std::move(handler));
+                send(relay, std::move(message),
+                     [shared](const SmtpResult& result) {
+                         (*shared)(result);
+                     });
+            },
+            token, std::move(message));
+    }
+
+  private:
+    struct Pending
+    {
+        SmtpRelay relay;
+        std::shared_ptr<const SmtpMessage> message;
+        Callback callback;
+        bool retried = false;
+    };
+
+    struct RelayPool
+    {
+        std::vector<std::shared_ptr<SmtpConnection>> idle;
+        std::deque<Pending> waiting;
+        size_t open = 0;
+    };
+
+    void pump(const std::string& key);
+    void run(const std::string& key,
+             const std::shared_ptr<SmtpConnection>& conn, Pending&& pending);
+    void release(const std::string& key,
+                 const std::shared_ptr<SmtpConnection>& conn);
+
+    boost::asio::io_service& io;
+    TlsContext& tls;
+    Resolver resolver;
+    size_t maxConnections = defaultSmtpPoolConnections;
+    std::map<std::string, RelayPool> pools;
+};
+
+} // namespace manager
+} // namespace alert
+} // namespace mail
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <boost/asio/ssl/context.hpp>
+#include <chrono>
+#include <map>
+#include <string>
+#include <tuple>
+
+namespace mail
+{
+namespace alert
+{
+namespace manager
+{
+
+/**
+ * TlsStats - handshakes, how many of them resumed a cached session and the
+ * average handshake time in microseconds, as returned by GetTlsStats.
+ */
+using TlsStats = std::tuple<uint64_t, uint64_t, uint64_t>;
+
+/**
+ * TlsContext - The process-wide client SSL_CTX. The CA store is loaded once
+ * when the daemon starts and every STARTTLS session is created from this
+ * context. The last session ticket (or session ID) handed out by each relay
+ * is kept and offered on the next handshake to that relay, so a reconnect
+ * costs an abbreviated handshake instead of a full one.
+ */
+class TlsContext
+{
+  public:
+    TlsContext();
+    ~TlsContext();
+
+    TlsContext(const TlsContext&) = delete;
+    TlsContext& operator=(const TlsContext&) = delete;
+
+    boost::asio::ssl::context& context()
+    {
+        return ctx;
+    }
+
+    /**
+     * prepare - Offer the cached session of the relay identified by key on
+     * ssl and remember key for the tickets it receives. key must outlive
+     * ssl.
+     */
+    void prepare(SSL* ssl, const std::string& key);
+
+    void recordHandshake(SSL* ssl, std::chrono::steady_clock::duration took);
+
+    TlsStats stats() const;
+
+  private:
+    static int onNewSession(SSL* ssl, SSL_SESSION* session);
+
+    boost::asio::ssl::context ctx;
+    std::map<std::string, SSL_SESSION*> sessions;
+    uint64_t handshakes = 0;
+    uint64_t resumed = 0;
+    uint64_t handshakeMicros = 0;
+};
+
+} // namespace manager
+} // namespace alert
+} // namespace mail
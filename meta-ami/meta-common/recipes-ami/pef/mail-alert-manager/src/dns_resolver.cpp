@@ -0,0 +1,127 @@
+#include "dns_resolver.hpp"
+
+#include <sys/socket.h>
+
+#include <boost/asio/post.hpp>
+#include <iostream>
+
+namespace mail
+{
+namespace alert
+{
+namespace manager
+{
+
+SmtpClient::Endpoints DnsResolver::endpoints(
+    const std::vector<boost::asio::ip::address>& addresses, uint16_t port)
+{
+    SmtpClient::Endpoints result;
+    result.reserve(addresses.size());
+    for (const auto& address : addresses)
+    {
+        result.emplace_back(address, port);
+    }
+    return result;
+}
+
+void DnsResolver::resolve(const std::string& host, uint16_t port,
+                          SmtpClient::ResolveHandler handler)
+{
+    Entry& entry = cache[host];
+    auto now = Clock::now();
+    bool usable = !entry.addresses.empty() &&
+                  (now < (entry.expires + staleWindow));
+    if (usable)
+    {
+        if ((now >= entry.expires) && !entry.refreshing)
+        {
+            query(host);
+        }
+        boost::asio::post(conn->get_io_context(),
+                          [handler = std::move(handler),
+                           found = endpoints(entry.addresses, port)]() mutable {
+                              handler(boost::system::error_code(),
+                                      std::move(found));
+                          });
+        return;
+    }
+
+    entry.waiters.emplace_back(port, std::move(handler));
+    if (!entry.refreshing)
+    {
+        query(host);
+    }
+}
+
+void DnsResolver::query(const std::string& host)
+{
+    cache[host].refreshing = true;
+    conn->async_method_call(
+        [this, host](boost::system::error_code ec,
+                     const std::vector<Address>& records, const std::string&,
+                     uint64_t) { answer(host, ec, records); },
+        resolvedService, resolvedObj, resolvedIntf, "ResolveHostname",
+        static_cast<int32_t>(0), host, static_cast<int32_t>(AF_UNSPEC),
+        static_cast<uint64_t>(0));
+}
+
+void DnsResolver::answer(const std::string& host,
+                         const boost::system::error_code& ec,
+                         const std::vector<Address>& records)
+{
+    Entry& entry = cache[host];
+    entry.refreshing = false;
+
+    std::vector<boost::asio::ip::address> addresses;
+    if (ec)
+    {
+        std::cerr << "Failed to resolve " << host << ": " << ec.message()
+                  << "\n";
+    }
+    for (const auto& [ifIndex, family, bytes] : records)
+    {
+        if ((family == AF_INET) && (bytes.size() == 4))
+        {
+            boost::asio::ip::address_v4::bytes_type v4;
+            std::copy(bytes.begin(), bytes.end(), v4.begin());
+            addresses.emplace_back(boost::asio::ip::address_v4(v4));
+        }
+        else if ((family == AF_INET6) && (bytes.size() == 16))
+        {
+            boost::asio::ip::address_v6::bytes_type v6;
+            std::copy(bytes.begin(), bytes.end(), v6.begin());
+            addresses.emplace_back(boost::asio::ip::address_v6(v6));
+        }
+    }
+
+    auto now = Clock::now();
+    if (!addresses.empty())
+    {
+        entry.addresses = std::move(addresses);
+        entry.expires = now + ttl;
+    }
+    else if (!entry.addresses.empty() && (now < (entry.expires + staleWindow)))
+    {
+        std::cerr << "Using the last known address of " << host << "\n";
+    }
+    else
+    {
+        entry.addresses.clear();
+    }
+
+    auto waiters = std::move(entry.waiters);
+    entry.waiters.clear();
+    for (auto& [port, handler] : waiters)
+    {
+        if (entry.addresses.empty())
+        {
+            handler(boost::asio::error::host_not_found, {});
+            continue;
+        }
+        handler(boost::system::error_code(), endpoints(entry.addresses, port));
+    }
+}
+
+} // namespace manager
+} // namespace alert
+} // namespace mail
@@ -0,0 +1,125 @@
+#include "libesmtp_worker.hpp"
+
+#include <sys/eventfd.h>
+
+#include <iostream>
+
+namespace mail
+{
+namespace alert
+{
+namespace manager
+{
+
+LibesmtpWorker::LibesmtpWorker(boost::asio::io_service& io, Smtp& smtp) :
+    io(io), smtp(smtp), eventFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+    notifier(io)
+{
+    if (eventFd < 0)
+    {
+        std::cerr << "LibesmtpWorker: eventfd failed: " << strerror(errno)
+                  << "\n";
+        return;
+    }
+    notifier.assign(eventFd);
+    watch();
+    thread = std::thread([this]() { run(); });
+}
+
+LibesmtpWorker::~LibesmtpWorker()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_one();
+    if (thread.joinable())
+    {
+        thread.join();
+    }
+}
+
+void LibesmtpWorker::send(const SmtpRelay& relay, SmtpMessage&& message,
+                          SmtpClient::Callback callback)
+{
+    if (!thread.joinable())
+    {
+        SmtpResult result;
+        result.rcptStatus.resize(message.recipients.size(),
+                                 smtpStatusTransportError);
+        io.post([callback, result]() { callback(result); });
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back(
+            {relay, std::move(message), std::move(callback), SmtpResult()});
+    }
+    wake.notify_one();
+}
+
+/* Worker thread: send queued messages until the worker is destroyed */
+void LibesmtpWorker::run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        wake.wait(lock, [this]() { return stopping || !pending.empty(); });
+        if (stopping)
+        {
+            return;
+        }
+        Request request = std::move(pending.front());
+        pending.pop_front();
+        lock.unlock();
+
+        std::tie(request.result.status, request.result.rcptStatus) =
+            smtp.sendmailMulti(request.relay, request.message.recipients,
+                               request.message.subject,
+                               request.message.body);
+
+        lock.lock();
+        finished.push_back(std::move(request));
+        uint64_t one = 1;
+        if (write(eventFd, &one, sizeof(one)) != sizeof(one))
+        {
+            std::cerr << "LibesmtpWorker: eventfd write failed\n";
+        }
+    }
+}
+
+void LibesmtpWorker::watch()
+{
+    notifier.async_wait(boost::asio::posix::stream_descriptor::wait_read,
+                        [this](const boost::system::error_code& ec) {
+                            if (ec)
+                            {
+                                return;
+                            }
+                            complete();
+                            watch();
+                        });
+}
+
+/* io_service side: run the callbacks of the sends that have finished */
+void LibesmtpWorker::complete()
+{
+    uint64_t count = 0;
+    if (read(eventFd, &count, sizeof(count)) < 0)
+    {
+        return;
+    }
+    std::deque<Request> done;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done.swap(finished);
+    }
+    for (auto& request : done)
+    {
+        request.callback(request.result);
+    }
+}
+
+} // namespace manager
+} // namespace alert
+} // namespace mail
@@ -1,9 +1,13 @@
 #include "mail_alert_manager.hpp"
 
+#include <sys/stat.h>
 #include <syslog.h>
 
+#include <algorithm>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
 
 namespace mail
 {
@@ -235,24 +239,69 @@ void print_recipient_status(smtp_recipient_t recipient, const char* mailbox,
 
     status = smtp_recipient_status(recipient);
     std::cerr << mailbox << status->code << status->text;
+
+    auto* rcptStatus = static_cast<std::map<std::string, uint16_t>*>(arg);
+    (*rcptStatus)[mailbox] = static_cast<uint16_t>(status->code);
 }
 
-uint16_t Smtp::sendmail(const std::string& recipient,
-                        const std::string& subject, const std::string& msg)
+/**
+ * MessageReader - State of readMessage. The message is an empty header
+ * section followed by the body; libesmtp adds the headers set on it.
+ */
+struct MessageReader
+{
+    const std::string* body;
+    int part;
+};
+
+/* smtp_set_messagecb callback, streams the body without copying it */
+static const char* readMessage(void** ctx, int* len, void* arg)
 {
+    static constexpr const char* crlf = "\r\n";
+    auto* reader = static_cast<MessageReader*>(arg);
 
-    if ((Smtp::enable == false) || Smtp::host.empty() || (Smtp::port == 0) ||
-        Smtp::sender.empty())
+    // A NULL len asks to rewind to the start of the message
+    if (len == NULL)
     {
-        return -1;
+        reader->part = 0;
+        return NULL;
+    }
+    switch (reader->part++)
+    {
+        case 0:
+            *len = 2;
+            return crlf;
+        case 1:
+            if (!reader->body->empty())
+            {
+                *len = static_cast<int>(reader->body->size());
+                return reader->body->data();
+            }
+            reader->part++;
+            [[fallthrough]];
+        case 2:
+            *len = 2;
+            return crlf;
+        default:
+            *len = 0;
+            return NULL;
     }
+}
+
+std::tuple<uint16_t, std::vector<uint16_t>>
+    Smtp::sendmailMulti(const SmtpRelay& relay,
+                        const std::vector<std::string>& recipients,
+                        const std::string& subject, const std::string& msg)
+{
+    std::vector<uint16_t> rcptResult(recipients.size(),
+                                     smtpStatusTransportError);
 
-    if (Smtp::enable == false)
+    if (relay.host.empty() || (relay.port == 0) || relay.sender.empty() ||
+        recipients.empty())
     {
-        return -2;
+        return {smtpStatusNotConfigured, rcptResult};
     }
 
-    auth_client_init();
     Smtp::session = smtp_create_session();
     Smtp::message = smtp_add_message(Smtp::session);
 
@@ -260,12 +309,25 @@ uint16_t Smtp::sendmail(const std::string& recipient,
 
     // smtp_set_header (message, "Disposition-Notification-To", NULL, NULL);
 
-    // smtp_starttls_enable (session, Starttls_ENABLED);
-    // smtp_starttls_enable (session, Starttls_REQUIRED);
+    if (relay.startTls != StartTls::disabled)
+    {
+        smtp_starttls_enable(Smtp::session,
+                             (relay.startTls == StartTls::required)
+                                 ? Starttls_REQUIRED
+                                 : Starttls_ENABLED);
+        if (Smtp::tlsContext != NULL)
+        {
+            // Share the process-wide context; the session drops its
+            // reference when destroyed.
+            SSL_CTX_up_ref(Smtp::tlsContext);
+            smtp_starttls_set_ctx(Smtp::session, Smtp::tlsContext);
+        }
+    }
 
-    char* Toch = new char[recipient.length() + 1];
-    strcpy(Toch, recipient.c_str());
-    smtp_set_header(Smtp::message, "To", NULL, Toch);
+    // libesmtp copies header values, server and reverse path, so they are
+    // built in buffers that keep their capacity from one send to the next.
+    Smtp::toHeader = mail::alert::manager::toHeader(recipients);
+    smtp_set_header(Smtp::message, "To", NULL, Smtp::toHeader.c_str());
     // smtp_set_header (Smtp::message, "Cc", NULL, NULL);
     // smtp_set_header (Smtp::message, "Bcc", NULL, NULL);
 
@@ -274,11 +336,10 @@ uint16_t Smtp::sendmail(const std::string& recipient,
     sa.sa_flags = 0;
     sigaction(SIGPIPE, &sa, NULL);
 
-    std::string smtpPort = std::to_string(Smtp::port);
-
-    char* hostch = new char[host.length() + smtpPort.length() + 2];
-    strcpy(hostch, (host + ":" + smtpPort).c_str());
-    smtp_set_server(Smtp::session, hostch);
+    char portBuffer[8];
+    snprintf(portBuffer, sizeof(portBuffer), "%u", relay.port);
+    Smtp::server.assign(relay.host).append(":").append(portBuffer);
+    smtp_set_server(Smtp::session, Smtp::server.c_str());
 
     Smtp::authctx = auth_create_context();
     auth_set_mechanism_flags(Smtp::authctx, AUTH_PLUGIN_PLAIN, 0);
@@ -290,26 +351,28 @@ uint16_t Smtp::sendmail(const std::string& recipient,
     // if (!noauth)
     // smtp_auth_set_context (Smtp::session, Smtp::authctx);
 
-    char* fromch = new char[sender.length() + 1];
-    strcpy(fromch, sender.c_str());
-    smtp_set_reverse_path(Smtp::message, fromch);
+    smtp_set_reverse_path(Smtp::message, relay.sender.c_str());
 
-    char* subch = new char[subject.length() + 1];
-    strcpy(subch, subject.c_str());
-    smtp_set_header(Smtp::message, "Subject", subch);
+    std::string subjectLine = headerValue(subject);
+    smtp_set_header(Smtp::message, "Subject", subjectLine.c_str());
     smtp_set_header_option(Smtp::message, "Subject", Hdr_OVERRIDE, 1);
 
-    char* msgch = new char[msg.length() + 5];
-    strcpy(msgch, ("\r\n" + msg + "\r\n").c_str());
-    smtp_set_message_str(Smtp::message, msgch);
+    // The body is handed over in place, msg outlives the session
+    MessageReader reader{&msg, 0};
+    smtp_set_messagecb(Smtp::message, readMessage, &reader);
 
-    smtp_add_recipient(Smtp::message, Toch);
+    // One transaction with a RCPT TO per recipient
+    for (const auto& recipient : recipients)
+    {
+        smtp_add_recipient(Smtp::message, recipient.c_str());
+    }
 
     /* Recipient options set here */
     //    if (notify != Notify_NOTSET)
     //      smtp_dsn_set_notify (recipient, notify);
     //  }
 
+    uint16_t mailStatus = smtpStatusTransportError;
     if (!smtp_start_session(Smtp::session))
     {
         std::cerr << "SMTP server problem \n";
@@ -318,13 +381,60 @@ uint16_t Smtp::sendmail(const std::string& recipient,
     {
         Smtp::status = smtp_message_transfer_status(Smtp::message);
         std::cerr << "SMTP mail status: " << Smtp::status->text << "\n";
-        smtp_enumerate_recipients(message, print_recipient_status, NULL);
+        mailStatus = ((Smtp::status->code / 100) == 2)
+                         ? smtpStatusOk
+                         : static_cast<uint16_t>(Smtp::status->code);
+
+        std::map<std::string, uint16_t> rcptStatus;
+        smtp_enumerate_recipients(message, print_recipient_status,
+                                  &rcptStatus);
+        for (size_t i = 0; i < recipients.size(); i++)
+        {
+            auto it = rcptStatus.find(recipients[i]);
+            if (it != rcptStatus.end())
+            {
+                rcptResult[i] = it->second;
+            }
+        }
     }
 
     smtp_destroy_session(Smtp::session);
     auth_destroy_context(Smtp::authctx);
-    auth_client_exit();
-    return 0;
+    return {mailStatus, rcptResult};
+}
+
+bool Smtp::isConfigured() const
+{
+    return Smtp::enable && !Smtp::sender.empty() &&
+           std::any_of(Smtp::relays.begin(), Smtp::relays.end(),
+                       [](const RelayEndpoint& relay) {
+                           return !relay.host.empty() && (relay.port != 0);
+                       });
+}
+
+SmtpRelay Smtp::relay() const
+{
+    SmtpRelay relay;
+    relay.host = Smtp::host;
+    relay.port = Smtp::port;
+    relay.sender = Smtp::sender;
+    relay.username = Smtp::username;
+    relay.password = Smtp::password;
+    relay.startTls = Smtp::startTls;
+    return relay;
+}
+
+static StartTls parseStartTls(const std::string& value)
+{
+    if (value == "Enabled")
+    {
+        return StartTls::enabled;
+    }
+    if (value == "Required")
+    {
+        return StartTls::required;
+    }
+    return StartTls::disabled;
 }
 
 std::tuple<bool, std::string, uint16_t, std::string> Smtp::getsmtpconfig()
@@ -335,31 +445,138 @@ std::tuple<bool, std::string, uint16_t, std::string> Smtp::getsmtpconfig()
     return smtpcfg;
 }
 
-uint16_t Smtp::setsmtpconfig(const bool enable, const std::string& host,
-                             const uint16_t& port, const std::string& sender)
+/* Read-modify-write of the config file, keeping settings update ignores */
+static void updateConfigFile(const std::function<void(Json&)>& update)
 {
+    Json jsonData;
+    std::ifstream oldFile(configFilePath);
+    if (oldFile.is_open())
+    {
+        jsonData = Json::parse(oldFile, nullptr, false);
+        if (jsonData.is_discarded() || !jsonData.is_object())
+        {
+            jsonData = Json::object();
+        }
+    }
+    oldFile.close();
 
-    std::ofstream configFile;
-    configFile.open(configFilePath, std::ios::out | std::ios::trunc);
-
-    Json privData, jsonData;
-    privData["Enabled"] = enable;
-    privData["Host"] = host;
-    privData["Port"] = port;
-    privData["Sender"] = sender;
+    update(jsonData["Config"]);
 
-    jsonData["Config"] = privData;
+    // The file holds the relay password: write it owner-only and replace
+    // the old one in a single rename
+    std::string tmpPath = std::string(configFilePath) + ".tmp";
+    int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0600);
+    if (fd < 0)
+    {
+        std::cerr << "updateConfigFile: Cannot create " << tmpPath << ": "
+                  << strerror(errno) << "\n";
+        return;
+    }
+    // O_CREAT does not change the mode of a stale temporary file
+    fchmod(fd, 0600);
+    std::string writeData = jsonData.dump(4) + "\n";
+    bool written = (write(fd, writeData.data(), writeData.size()) ==
+                    static_cast<ssize_t>(writeData.size())) &&
+                   (fsync(fd) == 0);
+    close(fd);
+    if (!written || (rename(tmpPath.c_str(), configFilePath) != 0))
+    {
+        std::cerr << "updateConfigFile: Cannot write " << configFilePath
+                  << ": " << strerror(errno) << "\n";
+        unlink(tmpPath.c_str());
+    }
+}
 
-    const auto& writeData = jsonData.dump(4);
-    configFile << writeData << std::endl;
+static RelayPolicy parseRelayPolicy(const std::string& value)
+{
+    if (value == "WeightedRoundRobin")
+    {
+        return RelayPolicy::weightedRoundRobin;
+    }
+    return RelayPolicy::failover;
+}
 
-    // close the opened file.
-    configFile.close();
+uint16_t Smtp::setsmtpconfig(const bool enable, const std::string& host,
+                             const uint16_t& port, const std::string& sender)
+{
+    if (!validAddress(sender))
+    {
+        return -1;
+    }
+    updateConfigFile([&](Json& privData) {
+        privData["Enabled"] = enable;
+        privData["Host"] = host;
+        privData["Port"] = port;
+        privData["Sender"] = sender;
+        // Host and Port name the primary relay
+        if (privData.contains("Relays") && privData["Relays"].is_array() &&
+            !privData["Relays"].empty())
+        {
+            privData["Relays"][0]["Host"] = host;
+            privData["Relays"][0]["Port"] = port;
+        }
+    });
 
     Smtp::enable = enable;
     Smtp::host = host;
     Smtp::port = port;
     Smtp::sender = sender;
+    if (Smtp::relays.empty())
+    {
+        Smtp::relays.push_back({host, port});
+    }
+    else
+    {
+        Smtp::relays[0].host = host;
+        Smtp::relays[0].port = port;
+    }
+
+    return 0;
+}
+
+std::vector<std::tuple<std::string, uint16_t, uint16_t>> Smtp::getRelays()
+{
+    std::vector<std::tuple<std::string, uint16_t, uint16_t>> list;
+    for (const auto& relay : Smtp::relays)
+    {
+        list.emplace_back(relay.host, relay.port, relay.weight);
+    }
+    return list;
+}
+
+uint16_t Smtp::setRelays(
+    const std::vector<std::tuple<std::string, uint16_t, uint16_t>>& list,
+    const std::string& policy)
+{
+    std::vector<RelayEndpoint> updated;
+    for (const auto& [host, port, weight] : list)
+    {
+        if (host.empty() || (port == 0))
+        {
+            return -1;
+        }
+        updated.push_back({host, port, weight});
+    }
+
+    updateConfigFile([&](Json& privData) {
+        Json relayList = Json::array();
+        for (const auto& relay : updated)
+        {
+            relayList.push_back({{"Host", relay.host},
+                                 {"Port", relay.port},
+                                 {"Weight", relay.weight}});
+        }
+        privData["Relays"] = relayList;
+        privData["RelayPolicy"] = policy;
+        privData["Host"] = updated.empty() ? "" : updated[0].host;
+        privData["Port"] = updated.empty() ? 0 : updated[0].port;
+    });
+
+    Smtp::relays = std::move(updated);
+    Smtp::relayPolicy = parseRelayPolicy(policy);
+    Smtp::host = Smtp::relays.empty() ? "" : Smtp::relays[0].host;
+    Smtp::port = Smtp::relays.empty() ? 0 : Smtp::relays[0].port;
 
     return 0;
 }
@@ -380,6 +597,45 @@ int Smtp::initializeSmtpcfg()
         Smtp::host = smtpConfig["Host"];
         Smtp::port = smtpConfig["Port"];
         Smtp::sender = smtpConfig["Sender"];
+        if (!validAddress(Smtp::sender))
+        {
+            // Left unconfigured rather than sent as MAIL FROM
+            std::cerr << "initializeSmtpcfg: Invalid sender address\n";
+            Smtp::sender.clear();
+        }
+        Smtp::username = smtpConfig.value("Username", "");
+        Smtp::password = smtpConfig.value("Password", "");
+        Smtp::startTls =
+            parseStartTls(smtpConfig.value("StartTLS", "Enabled"));
+        Smtp::useLibesmtp = (smtpConfig.value("Engine", "asio") == "libesmtp");
+        Smtp::queueCapacity =
+            smtpConfig.value("QueueCapacity", defaultMailQueueCapacity);
+        Smtp::workers = smtpConfig.value("Workers", defaultMailWorkers);
+        Smtp::relays.clear();
+        for (const auto& relay : smtpConfig.value("Relays", Json::array()))
+        {
+            Smtp::relays.push_back({relay.value("Host", ""),
+                                    relay.value("Port", uint16_t{0}),
+                                    relay.value("Weight", uint16_t{1})});
+        }
+        if (Smtp::relays.empty() && !Smtp::host.empty() && (Smtp::port != 0))
+        {
+            Smtp::relays.push_back({Smtp::host, Smtp::port});
+        }
+        Smtp::relayPolicy =
+            parseRelayPolicy(smtpConfig.value("RelayPolicy", "Failover"));
+        Smtp::dnsCacheTtl = std::chrono::seconds(smtpConfig.value(
+            "DnsCacheTtl", defaultDnsCacheTtl.count()));
+        Smtp::dnsStaleWindow = std::chrono::seconds(smtpConfig.value(
+            "DnsStaleWindow", defaultDnsStaleWindow.count()));
+        Smtp::digestWindow = std::chrono::seconds(smtpConfig.value(
+            "DigestWindow", defaultMailDigestWindow.count()));
+        Smtp::spoolMaxBytes =
+            smtpConfig.value("SpoolMaxBytes", defaultMailSpoolMaxBytes);
+        Smtp::spoolEviction =
+            (smtpConfig.value("SpoolEviction", "DropOldest") == "RejectNew")
+                ? SpoolEviction::rejectNew
+                : SpoolEviction::dropOldest;
     }
     catch (nlohmann::json::exception& e)
     {
@@ -4,6 +4,7 @@
  *Email : selvaganapathim@ami.com
  *
  * ******************************/
+#include "libesmtp_worker.hpp"
 #include "mail_alert_manager.hpp"
 
 #include <boost/asio/io_service.hpp>
@@ -27,12 +28,192 @@ int main()
 
     objsmtp.initializeSmtpcfg();
 
-    // Register SendMail method
-    smtpIface->register_method("SendMail", [&](const std::string& recipient,
-                                               const std::string& subject,
-                                               const std::string& msg) {
-        return objsmtp.sendmail(recipient, subject, msg);
+    // One TLS context and one SASL client setup for the whole process
+    mail::alert::manager::TlsContext tlsContext;
+    objsmtp.tlsContext = tlsContext.context().native_handle();
+    auth_client_init();
+
+    mail::alert::manager::SmtpClient smtpClient(io, tlsContext);
+    mail::alert::manager::DnsResolver dnsResolver(conn);
+    dnsResolver.configure(objsmtp.dnsCacheTtl, objsmtp.dnsStaleWindow);
+    smtpClient.setResolver([&dnsResolver](const std::string& host,
+                                          uint16_t port, auto handler) {
+        dnsResolver.resolve(host, port, std::move(handler));
     });
+    smtpClient.setMaxConnections(objsmtp.workers);
+    mail::alert::manager::RelayBalancer relayBalancer(smtpClient);
+    relayBalancer.configure(objsmtp.relays, objsmtp.relayPolicy);
+
+    // The fallback engine blocks, it runs on a thread of its own
+    mail::alert::manager::LibesmtpWorker libesmtpWorker(io, objsmtp);
+
+    // Queue behind SendMailAsync, completions are reported by MailDelivered
+    mail::alert::manager::MailQueue mailQueue(
+        [&](mail::alert::manager::SmtpMessage&& message, auto callback) {
+            if (!objsmtp.isConfigured())
+            {
+                mail::alert::manager::SmtpResult result;
+                result.status = mail::alert::manager::smtpStatusNotConfigured;
+                io.post([callback, result]() { callback(result); });
+                return;
+            }
+            if (objsmtp.useLibesmtp)
+            {
+                libesmtpWorker.send(objsmtp.relay(), std::move(message),
+                                    std::move(callback));
+                return;
+            }
+            relayBalancer.send(objsmtp.relay(), std::move(message),
+                               std::move(callback));
+        },
+        [&smtpIface](uint64_t jobId, uint16_t status, uint32_t latencyMs) {
+            auto signal = smtpIface->new_signal("MailDelivered");
+            signal.append(jobId, status, latencyMs);
+            signal.signal_send();
+        });
+    mailQueue.configure(objsmtp.queueCapacity, objsmtp.workers);
+
+    // Mail accepted by SendMailAsync survives a crash or reboot
+    mail::alert::manager::MailSpool mailSpool(
+        io, mail::alert::manager::mailSpoolDir);
+    mailQueue.attachSpool(mailSpool, objsmtp.spoolMaxBytes,
+                          objsmtp.spoolEviction);
+
+    // Optional merging of alert storms into one mail per recipient list
+    mail::alert::manager::MailDigest mailDigest(io, mailQueue);
+    mailDigest.configure(objsmtp.digestWindow);
+    mailDigest.restore(mailSpool.takeHeld());
+
+    // Register SendMail method. Either engine suspends only this call, the
+    // daemon keeps serving other requests while the mail is in flight.
+    smtpIface->register_method(
+        "SendMail",
+        [&](boost::asio::yield_context yield, const std::string& recipient,
+            const std::string& subject, const std::string& msg) -> uint16_t {
+            if (!objsmtp.isConfigured())
+            {
+                return mail::alert::manager::smtpStatusNotConfigured;
+            }
+            if (!mail::alert::manager::validAddress(recipient))
+            {
+                return mail::alert::manager::smtpStatusBadAddress;
+            }
+            mail::alert::manager::SmtpMessage message;
+            message.recipients.push_back(recipient);
+            message.subject = subject;
+            message.body = msg;
+            if (objsmtp.useLibesmtp)
+            {
+                return libesmtpWorker
+                    .asyncSend(objsmtp.relay(), std::move(message), yield)
+                    .status;
+            }
+            auto result = relayBalancer.asyncSend(objsmtp.relay(),
+                                                  std::move(message), yield);
+            return result.status;
+        });
+
+    // Register SendMailMulti method. The message is sent once with a RCPT TO
+    // per recipient; the reply carries the RCPT status of each of them. An
+    // address that is not valid gets smtpStatusBadAddress and is left out.
+    smtpIface->register_method(
+        "SendMailMulti",
+        [&](boost::asio::yield_context yield,
+            const std::vector<std::string>& recipients,
+            const std::string& subject, const std::string& msg)
+            -> std::tuple<uint16_t, std::vector<uint16_t>> {
+            if (!objsmtp.isConfigured() || recipients.empty())
+            {
+                return {mail::alert::manager::smtpStatusNotConfigured,
+                        std::vector<uint16_t>(
+                            recipients.size(),
+                            mail::alert::manager::smtpStatusTransportError)};
+            }
+            std::vector<uint16_t> rcptStatus(
+                recipients.size(),
+                mail::alert::manager::smtpStatusTransportError);
+            mail::alert::manager::SmtpMessage message;
+            for (size_t i = 0; i < recipients.size(); i++)
+            {
+                if (mail::alert::manager::validAddress(recipients[i]))
+                {
+                    message.recipients.push_back(recipients[i]);
+                }
+                else
+                {
+                    rcptStatus[i] = mail::alert::manager::smtpStatusBadAddress;
+                }
+            }
+            if (message.recipients.empty())
+            {
+                return {mail::alert::manager::smtpStatusBadAddress,
+                        rcptStatus};
+            }
+            message.subject = subject;
+            message.body = msg;
+            auto result =
+                objsmtp.useLibesmtp
+                    ? libesmtpWorker.asyncSend(objsmtp.relay(),
+                                               std::move(message), yield)
+                    : relayBalancer.asyncSend(objsmtp.relay(),
+                                              std::move(message), yield);
+            // Spread the replies over the positions of the valid addresses
+            size_t sent = 0;
+            for (auto& status : rcptStatus)
+            {
+                if (status == mail::alert::manager::smtpStatusBadAddress)
+                {
+                    continue;
+                }
+                if (sent < result.rcptStatus.size())
+                {
+                    status = result.rcptStatus[sent];
+                }
+                sent++;
+            }
+            return {result.status, rcptStatus};
+        });
+
+    // Register SendMailAsync method. Returns the job ID at once, 0 if the
+    // queue is full or no address is valid. Addresses that are not valid
+    // are logged and left out. Messages merged into one digest share their
+    // job ID.
+    smtpIface->register_method(
+        "SendMailAsync", [&](const std::vector<std::string>& recipients,
+                             const std::string& subject,
+                             const std::string& msg) -> uint64_t {
+            mail::alert::manager::SmtpMessage message;
+            for (const auto& recipient : recipients)
+            {
+                if (mail::alert::manager::validAddress(recipient))
+                {
+                    message.recipients.push_back(recipient);
+                }
+                else
+                {
+                    std::cerr << "SendMailAsync: invalid recipient address "
+                              << mail::alert::manager::headerValue(recipient)
+                              << "\n";
+                }
+            }
+            if (message.recipients.empty())
+            {
+                return 0;
+            }
+            message.subject = subject;
+            message.body = msg;
+            return mailDigest.submit(std::move(message));
+        });
+
+    // Register GetQueueStatus method
+    smtpIface->register_method("GetQueueStatus",
+                               [&]() { return mailQueue.status(); });
+
+    smtpIface->register_signal<uint64_t, uint16_t, uint32_t>("MailDelivered");
+
+    // Register GetTlsStats method, shows whether sessions get resumed
+    smtpIface->register_method("GetTlsStats",
+                               [&]() { return tlsContext.stats(); });
 
     // Register getsmtpconfig method
     smtpIface->register_method("GetSmtpConfig",
@@ -42,9 +223,31 @@ int main()
     smtpIface->register_method(
         "SetSmtpConfig", [&](bool enable, const std::string& host,
                              const uint16_t& port, const std::string& sender) {
-            return objsmtp.setsmtpconfig(enable, host, port, sender);
+            auto ret = objsmtp.setsmtpconfig(enable, host, port, sender);
+            relayBalancer.configure(objsmtp.relays, objsmtp.relayPolicy);
+            return ret;
         });
 
+    // Register GetSmtpRelays method, the ordered (host, port, weight) list
+    smtpIface->register_method("GetSmtpRelays",
+                               [&]() { return objsmtp.getRelays(); });
+
+    // Register SetSmtpRelays method. policy is "Failover" or
+    // "WeightedRoundRobin"; the first relay becomes Host/Port.
+    smtpIface->register_method(
+        "SetSmtpRelays",
+        [&](const std::vector<std::tuple<std::string, uint16_t, uint16_t>>&
+                relays,
+            const std::string& policy) {
+            auto ret = objsmtp.setRelays(relays, policy);
+            relayBalancer.configure(objsmtp.relays, objsmtp.relayPolicy);
+            return ret;
+        });
+
+    // Register GetRelayHealth method
+    smtpIface->register_method("GetRelayHealth",
+                               [&]() { return relayBalancer.health(); });
+
     smtpIface->initialize();
 
     io.run();
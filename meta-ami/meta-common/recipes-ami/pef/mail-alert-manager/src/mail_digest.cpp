@@ -0,0 +1,232 @@
+#include "mail_digest.hpp"
+
+#include <algorithm>
+#include <ctime>
+#include <iostream>
+
+namespace mail
+{
+namespace alert
+{
+namespace manager
+{
+
+static std::string trim(const std::string& text)
+{
+    size_t begin = text.find_first_not_of(" \t\r\n");
+    if (begin == std::string::npos)
+    {
+        return "";
+    }
+    size_t end = text.find_last_not_of(" \t\r\n");
+    return text.substr(begin, end - begin + 1);
+}
+
+/* Split a body into its non-empty lines */
+static std::vector<std::string> bodyLines(const std::string& body)
+{
+    std::vector<std::string> lines;
+    size_t pos = 0;
+    while (pos <= body.size())
+    {
+        size_t end = body.find('\n', pos);
+        if (end == std::string::npos)
+        {
+            end = body.size();
+        }
+        std::string line = trim(body.substr(pos, end - pos));
+        if (!line.empty())
+        {
+            lines.push_back(std::move(line));
+        }
+        pos = end + 1;
+    }
+    return lines;
+}
+
+static std::string timeOfDay(std::chrono::system_clock::time_point when)
+{
+    time_t t = std::chrono::system_clock::to_time_t(when);
+    struct tm tm = {};
+    localtime_r(&t, &tm);
+    char text[16];
+    strftime(text, sizeof(text), "%H:%M:%S", &tm);
+    return text;
+}
+
+bool MailDigest::isCritical(const std::string& body)
+{
+    for (const auto& line : bodyLines(body))
+    {
+        size_t colon = line.find(':');
+        if ((line.rfind("Severity", 0) == 0) && (colon != std::string::npos) &&
+            (trim(line.substr(colon + 1)) == "Critical"))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint64_t MailDigest::submit(SmtpMessage&& message)
+{
+    if (window.count() == 0)
+    {
+        return queue.submit(std::move(message));
+    }
+
+    std::vector<std::string> sorted = message.recipients;
+    std::sort(sorted.begin(), sorted.end());
+    std::string key;
+    for (const auto& rcpt : sorted)
+    {
+        key += rcpt + "\n";
+    }
+
+    bool critical = isCritical(message.body);
+    auto it = digests.find(key);
+    if (it == digests.end())
+    {
+        if (critical)
+        {
+            return queue.submit(std::move(message));
+        }
+        Digest& digest = digests[key];
+        digest.jobId = queue.reserveId();
+        digest.recipients = message.recipients;
+        digest.timer = std::make_unique<boost::asio::steady_timer>(io);
+        digest.timer->expires_after(window);
+        digest.timer->async_wait(
+            [this, key](const boost::system::error_code& ec) {
+                if (ec)
+                {
+                    return;
+                }
+                flush(key);
+            });
+        it = digests.find(key);
+    }
+
+    Digest& digest = it->second;
+    uint64_t id = digest.jobId;
+    digest.events.push_back({std::chrono::system_clock::now(),
+                             std::move(message.subject),
+                             std::move(message.body)});
+    if (critical || (digest.events.size() >= mailDigestMaxEvents))
+    {
+        flush(key);
+        return id;
+    }
+    const Event& event = digest.events.back();
+    HeldEvent held{id, static_cast<uint32_t>(digest.events.size() - 1),
+                   SmtpMessage{digest.recipients, event.subject, event.body},
+                   event.received};
+    if (!queue.hold(held))
+    {
+        // Still sent with the digest, just not across a restart
+        std::cerr << "Mail digest " << id << " event not spooled\n";
+    }
+    return id;
+}
+
+void MailDigest::restore(std::vector<HeldEvent>&& events)
+{
+    size_t begin = 0;
+    while (begin < events.size())
+    {
+        Digest digest;
+        digest.jobId = events[begin].id;
+        digest.recipients = std::move(events[begin].message.recipients);
+        size_t end = begin;
+        for (; (end < events.size()) && (events[end].id == digest.jobId);
+             end++)
+        {
+            digest.events.push_back({events[end].received,
+                                     std::move(events[end].message.subject),
+                                     std::move(events[end].message.body)});
+        }
+        std::cerr << "Mail digest " << digest.jobId << " resumed with "
+                  << digest.events.size() << " events\n";
+        queue.submitReserved(compose(digest), digest.jobId);
+        begin = end;
+    }
+}
+
+void MailDigest::flush(const std::string& key)
+{
+    auto it = digests.find(key);
+    if (it == digests.end())
+    {
+        return;
+    }
+    Digest digest = std::move(it->second);
+    digests.erase(it);
+    digest.timer->cancel();
+    queue.submitReserved(compose(digest), digest.jobId);
+}
+
+/**
+ * compose - A single event is sent as it was submitted. Several become one
+ * mail with a row per event: the time it arrived, its subject when they
+ * differ, and the values of its body lines ("Name : value" pairs as in PEF
+ * alerts) separated by '|'. A header row names the columns after the
+ * first event.
+ */
+SmtpMessage MailDigest::compose(const Digest& digest)
+{
+    SmtpMessage message;
+    message.recipients = digest.recipients;
+    if (digest.events.size() == 1)
+    {
+        message.subject = digest.events[0].subject;
+        message.body = digest.events[0].body;
+        return message;
+    }
+
+    const std::string& first = digest.events.front().subject;
+    bool sameSubject = std::all_of(
+        digest.events.begin(), digest.events.end(),
+        [&first](const Event& event) { return event.subject == first; });
+    message.subject = "[" + std::to_string(digest.events.size()) +
+                      " alerts] " + first;
+
+    std::string& body = message.body;
+    body = std::to_string(digest.events.size()) + " alerts between " +
+           timeOfDay(digest.events.front().received) + " and " +
+           timeOfDay(digest.events.back().received) + "\r\n\r\n";
+    body += "Time";
+    if (!sameSubject)
+    {
+        body += " | Subject";
+    }
+    for (const auto& line : bodyLines(digest.events.front().body))
+    {
+        size_t colon = line.find(':');
+        body += " | ";
+        body += (colon == std::string::npos) ? "Text"
+                                             : trim(line.substr(0, colon));
+    }
+    body += "\r\n";
+    for (const auto& event : digest.events)
+    {
+        body += timeOfDay(event.received);
+        if (!sameSubject)
+        {
+            body += " | " + event.subject;
+        }
+        for (const auto& line : bodyLines(event.body))
+        {
+            size_t colon = line.find(':');
+            body += " | ";
+            body += (colon == std::string::npos)
+                        ? line
+                        : trim(line.substr(colon + 1));
+        }
+        body += "\r\n";
+    }
+    return message;
+}
+
+} // namespace manager
+} // namespace alert
+} // namespace mail
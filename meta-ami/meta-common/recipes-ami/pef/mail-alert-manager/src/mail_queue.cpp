@@ -0,0 +1,192 @@
+#include "mail_queue.hpp"
+
+#include "mail_spool.hpp"
+
+#include <algorithm>
+#include <iostream>
+
+namespace mail
+{
+namespace alert
+{
+namespace manager
+{
+
+MailQueue::MailQueue(Sender sender, DoneHandler onDone) :
+    sender(std::move(sender)), onDone(std::move(onDone))
+{}
+
+void MailQueue::configure(size_t capacity, size_t workers)
+{
+    this->capacity = (capacity == 0) ? defaultMailQueueCapacity : capacity;
+    this->workers = (workers == 0) ? defaultMailWorkers : workers;
+    drain();
+}
+
+void MailQueue::attachSpool(MailSpool& spool, size_t maxBytes,
+                            SpoolEviction eviction)
+{
+    this->spool = &spool;
+    spoolMaxBytes = (maxBytes == 0) ? defaultMailSpoolMaxBytes : maxBytes;
+    this->eviction = eviction;
+
+    std::vector<MailJob> restored = spool.load();
+    // IDs handed out before the restart may still be known to clients
+    nextId = std::max(nextId, spool.idLimit());
+    if (!restored.empty())
+    {
+        std::cerr << "Mail spool replaying " << restored.size()
+                  << " undelivered messages\n";
+        nextId = std::max(nextId, restored.back().id + 1);
+    }
+    idLimit = nextId;
+    for (auto& job : restored)
+    {
+        jobs.push_back(std::move(job));
+    }
+    drain();
+}
+
+/**
+ * reserve - Make room for bytes more in the spool, evicting the oldest
+ * queued jobs if the policy allows it. replaced bytes of records the new
+ * one supersedes are not counted. Jobs already handed to the sender are
+ * never evicted.
+ */
+bool MailQueue::reserve(size_t bytes, size_t replaced)
+{
+    while ((spool->pendingBytes() - replaced + bytes) > spoolMaxBytes)
+    {
+        if ((eviction == SpoolEviction::rejectNew) || jobs.empty())
+        {
+            return false;
+        }
+        MailJob victim = std::move(jobs.front());
+        jobs.pop_front();
+        spool->remove(victim.id);
+        failed++;
+        std::cerr << "Mail spool full, evicted job " << victim.id << "\n";
+        auto latency = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - victim.queued);
+        onDone(victim.id, smtpStatusEvicted,
+               static_cast<uint32_t>(latency.count()));
+    }
+    return true;
+}
+
+uint64_t MailQueue::reserveId()
+{
+    if (spool && (nextId >= idLimit))
+    {
+        idLimit = spool->reserveIds(nextId, mailSpoolIdBlock);
+    }
+    return nextId++;
+}
+
+uint64_t MailQueue::submit(SmtpMessage&& message)
+{
+    uint64_t id = reserveId();
+    if (!enqueue(std::move(message), id))
+    {
+        return 0;
+    }
+    return id;
+}
+
+void MailQueue::submitReserved(SmtpMessage&& message, uint64_t id)
+{
+    if (!enqueue(std::move(message), id))
+    {
+        if (spool)
+        {
+            // Drop a held copy, the refusal is final
+            spool->remove(id);
+        }
+        failed++;
+        onDone(id, smtpStatusEvicted, 0);
+    }
+}
+
+bool MailQueue::hold(const HeldEvent& event)
+{
+    if (spool == nullptr)
+    {
+        return true;
+    }
+    if (!reserve(MailSpool::recordSize(event.message, true)))
+    {
+        return false;
+    }
+    return spool->hold(event);
+}
+
+bool MailQueue::enqueue(SmtpMessage&& message, uint64_t id)
+{
+    // Held digest events are dropped once the digest is written
+    if (((jobs.size() + inFlight) >= capacity) ||
+        (spool && !reserve(MailSpool::recordSize(message),
+                           spool->pendingBytes(id))))
+    {
+        rejected++;
+        std::cerr << "Mail queue full, message to "
+                  << (message.recipients.empty() ? ""
+                                                 : message.recipients[0])
+                  << " rejected\n";
+        return false;
+    }
+    jobs.push_back({id, std::move(message), std::chrono::steady_clock::now()});
+    if (spool && !spool->append(jobs.back()))
+    {
+        // Still deliverable, just not across a restart
+        std::cerr << "Mail job " << id << " not spooled\n";
+    }
+    drain();
+    return true;
+}
+
+MailQueueStatus MailQueue::status() const
+{
+    return {static_cast<uint32_t>(jobs.size()),
+            static_cast<uint32_t>(inFlight), static_cast<uint32_t>(capacity),
+            delivered, failed, rejected};
+}
+
+void MailQueue::drain()
+{
+    while ((inFlight < workers) && !jobs.empty())
+    {
+        MailJob job = std::move(jobs.front());
+        jobs.pop_front();
+        inFlight++;
+        sender(std::move(job.message),
+               [this, id = job.id, queued = job.queued](
+                   const SmtpResult& result) { complete(id, queued, result); });
+    }
+}
+
+void MailQueue::complete(uint64_t jobId,
+                         std::chrono::steady_clock::time_point queued,
+                         const SmtpResult& result)
+{
+    inFlight--;
+    if (spool)
+    {
+        spool->remove(jobId);
+    }
+    if (result.status == smtpStatusOk)
+    {
+        delivered++;
+    }
+    else
+    {
+        failed++;
+    }
+    auto latency = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - queued);
+    onDone(jobId, result.status, static_cast<uint32_t>(latency.count()));
+    drain();
+}
+
+} // namespace manager
+} // namespace alert
+} // namespace mail
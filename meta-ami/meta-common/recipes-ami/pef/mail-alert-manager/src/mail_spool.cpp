@@ -0,0 +1,755 @@
+#include "mail_spool.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <boost/crc.hpp>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+
+namespace mail
+{
+namespace alert
+{
+namespace manager
+{
+
+static constexpr uint32_t mailSpoolMagic = 0x4d53504c; // "MSPL"
+static constexpr const char* mailSpoolIdFile = "next-id";
+
+enum class SpoolState : uint8_t
+{
+    pending = 0xa5,
+    done = 0x5a,
+};
+
+/* What a record holds; spools without held events have 0 there */
+enum class SpoolKind : uint8_t
+{
+    job = 0,
+    heldEvent = 1,
+};
+
+/**
+ * SpoolRecordHeader - Precedes every record. The CRC covers the payload;
+ * the state byte is the only field rewritten in place.
+ */
+struct SpoolRecordHeader
+{
+    uint32_t magic;
+    uint32_t length;
+    uint32_t crc;
+    uint8_t state;
+    uint8_t kind;
+    uint8_t reserved[2];
+} __attribute__((packed));
+
+static_assert(sizeof(SpoolRecordHeader) == 16,
+              "spool record header must stay 16 bytes");
+
+static uint32_t checksum(const char* data, size_t length)
+{
+    boost::crc_32_type crc;
+    crc.process_bytes(data, length);
+    return crc.checksum();
+}
+
+template <typename T>
+static void put(std::string& out, T value)
+{
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+static bool get(const char*& pos, const char* end, T& value)
+{
+    if (static_cast<size_t>(end - pos) < sizeof(value))
+    {
+        return false;
+    }
+    std::memcpy(&value, pos, sizeof(value));
+    pos += sizeof(value);
+    return true;
+}
+
+template <typename T>
+static bool getString(const char*& pos, const char* end, std::string& value)
+{
+    T length = 0;
+    if (!get(pos, end, length) || (static_cast<size_t>(end - pos) < length))
+    {
+        return false;
+    }
+    value.assign(pos, length);
+    pos += length;
+    return true;
+}
+
+/* A job record, or a held event record when event is given */
+static std::string encodeRecord(uint64_t id, const SmtpMessage& message,
+                                const HeldEvent* event = nullptr)
+{
+    std::string payload;
+    payload.reserve(MailSpool::recordSize(message, event != nullptr));
+    put<uint64_t>(payload, id);
+    put<uint16_t>(payload, static_cast<uint16_t>(message.recipients.size()));
+    for (const auto& rcpt : message.recipients)
+    {
+        put<uint16_t>(payload, static_cast<uint16_t>(rcpt.size()));
+        payload += rcpt;
+    }
+    put<uint32_t>(payload, static_cast<uint32_t>(message.subject.size()));
+    payload += message.subject;
+    put<uint32_t>(payload, static_cast<uint32_t>(message.body.size()));
+    payload += message.body;
+    if (event != nullptr)
+    {
+        put<uint32_t>(payload, event->part);
+        put<int64_t>(payload,
+                     std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         event->received.time_since_epoch())
+                         .count());
+    }
+
+    SpoolRecordHeader header = {};
+    header.magic = mailSpoolMagic;
+    header.length = static_cast<uint32_t>(payload.size());
+    header.crc = checksum(payload.data(), payload.size());
+    header.state = static_cast<uint8_t>(SpoolState::pending);
+    header.kind = static_cast<uint8_t>((event != nullptr)
+                                           ? SpoolKind::heldEvent
+                                           : SpoolKind::job);
+
+    std::string record(reinterpret_cast<const char*>(&header), sizeof(header));
+    record += payload;
+    return record;
+}
+
+/* Decode a record of either kind; part and received are only in events */
+static bool decodeRecord(const char* pos, const char* end, uint8_t kind,
+                         HeldEvent& entry)
+{
+    uint16_t count = 0;
+    if (!get(pos, end, entry.id) || !get(pos, end, count))
+    {
+        return false;
+    }
+    entry.message.recipients.resize(count);
+    for (auto& rcpt : entry.message.recipients)
+    {
+        if (!getString<uint16_t>(pos, end, rcpt))
+        {
+            return false;
+        }
+    }
+    if (!getString<uint32_t>(pos, end, entry.message.subject) ||
+        !getString<uint32_t>(pos, end, entry.message.body))
+    {
+        return false;
+    }
+    if (kind == static_cast<uint8_t>(SpoolKind::job))
+    {
+        return true;
+    }
+    int64_t received = 0;
+    if ((kind != static_cast<uint8_t>(SpoolKind::heldEvent)) ||
+        !get(pos, end, entry.part) || !get(pos, end, received))
+    {
+        return false;
+    }
+    entry.received = std::chrono::system_clock::time_point(
+        std::chrono::duration_cast<std::chrono::system_clock::duration>(
+            std::chrono::nanoseconds(received)));
+    return true;
+}
+
+/**
+ * parseRecord - Check for a complete, intact record at offset of a
+ * segment image and decode it.
+ */
+static bool parseRecord(const std::string& data, size_t offset,
+                        SpoolRecordHeader& header, HeldEvent& entry)
+{
+    if (offset + sizeof(header) > data.size())
+    {
+        return false;
+    }
+    std::memcpy(&header, data.data() + offset, sizeof(header));
+    const char* payload = data.data() + offset + sizeof(header);
+    return (header.magic == mailSpoolMagic) &&
+           (header.length <= data.size() - offset - sizeof(header)) &&
+           (header.crc == checksum(payload, header.length)) &&
+           decodeRecord(payload, payload + header.length, header.kind,
+                        entry);
+}
+
+/**
+ * nextRecord - Offset of the first intact record after a corrupt one, or
+ * the end of the segment image when there is none.
+ */
+static size_t nextRecord(const std::string& data, size_t offset)
+{
+    uint32_t magic = mailSpoolMagic;
+    for (size_t pos = offset + 1;
+         pos + sizeof(SpoolRecordHeader) <= data.size(); pos++)
+    {
+        SpoolRecordHeader header;
+        HeldEvent entry;
+        if ((std::memcmp(data.data() + pos, &magic, sizeof(magic)) == 0) &&
+            parseRecord(data, pos, header, entry))
+        {
+            return pos;
+        }
+    }
+    return data.size();
+}
+
+MailSpool::MailSpool(boost::asio::io_service& io, const std::string& dir) :
+    syncTimer(io), dir(dir)
+{}
+
+MailSpool::~MailSpool()
+{
+    sync();
+    for (auto& [seq, segment] : segments)
+    {
+        close(segment.fd);
+    }
+}
+
+size_t MailSpool::recordSize(const SmtpMessage& message, bool held)
+{
+    size_t size = sizeof(SpoolRecordHeader) + sizeof(uint64_t) +
+                  sizeof(uint16_t) + 2 * sizeof(uint32_t) +
+                  message.subject.size() + message.body.size();
+    if (held)
+    {
+        size += sizeof(uint32_t) + sizeof(int64_t);
+    }
+    for (const auto& rcpt : message.recipients)
+    {
+        size += sizeof(uint16_t) + rcpt.size();
+    }
+    return size;
+}
+
+std::string MailSpool::segmentPath(uint32_t seq) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "segment-%08u.log", seq);
+    return dir + "/" + name;
+}
+
+bool MailSpool::openSegment(uint32_t seq, bool create)
+{
+    int flags = O_RDWR | O_CLOEXEC | (create ? (O_CREAT | O_EXCL) : 0);
+    int fd = ::open(segmentPath(seq).c_str(), flags, S_IRUSR | S_IWUSR);
+    if (fd < 0)
+    {
+        std::cerr << "Failed to open mail spool segment " << seq << ": "
+                  << strerror(errno) << "\n";
+        return false;
+    }
+    segments[seq].fd = fd;
+    return true;
+}
+
+std::vector<MailJob> MailSpool::load()
+{
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+    std::vector<uint32_t> seqs;
+    for (const auto& entry : std::filesystem::directory_iterator(dir, ec))
+    {
+        unsigned int seq = 0;
+        std::string name = entry.path().filename().string();
+        if (sscanf(name.c_str(), "segment-%08u.log", &seq) == 1)
+        {
+            seqs.push_back(seq);
+        }
+    }
+    std::sort(seqs.begin(), seqs.end());
+
+    FILE* idFile = fopen((dir + "/" + mailSpoolIdFile).c_str(), "r");
+    if (idFile != nullptr)
+    {
+        unsigned long long limit = 0;
+        if ((fscanf(idFile, "%llu", &limit) == 1) && (limit > claimedIds))
+        {
+            claimedIds = limit;
+        }
+        fclose(idFile);
+    }
+
+    std::map<uint64_t, MailJob> pending;
+    std::map<std::pair<uint64_t, uint32_t>, HeldEvent> events;
+    std::map<std::pair<uint64_t, uint32_t>, Location> eventLocations;
+    auto discard = [this](uint64_t id, const Location& loc) {
+        Segment& stale = segments[loc.segment];
+        stale.live--;
+        stale.liveBytes -= loc.length;
+        liveTotal -= loc.length;
+        markDone(loc);
+        unindex(id, loc);
+    };
+    for (uint32_t seq : seqs)
+    {
+        if (!openSegment(seq, false))
+        {
+            continue;
+        }
+        Segment& segment = segments[seq];
+        struct stat st = {};
+        fstat(segment.fd, &st);
+        std::string data(static_cast<size_t>(st.st_size), '\0');
+        ssize_t got = pread(segment.fd, data.data(), data.size(), 0);
+        data.resize((got < 0) ? 0 : static_cast<size_t>(got));
+        size_t size = data.size();
+
+        size_t offset = 0;
+        while (offset + sizeof(SpoolRecordHeader) <= size)
+        {
+            SpoolRecordHeader header;
+            HeldEvent entry;
+            if (!parseRecord(data, offset, header, entry))
+            {
+                // Only a torn tail is cut off; the intact records behind
+                // a damaged one are still pending mail
+                size_t next = nextRecord(data, offset);
+                if (next == size)
+                {
+                    break;
+                }
+                std::cerr << "Mail spool segment " << seq << " skipping "
+                          << (next - offset) << " corrupt bytes at "
+                          << offset << "\n";
+                offset = next;
+                continue;
+            }
+            size_t length = sizeof(header) + header.length;
+            uint64_t id = entry.id;
+            std::pair<uint64_t, uint32_t> part(id, entry.part);
+            if (header.state != static_cast<uint8_t>(SpoolState::pending))
+            {
+                offset += length;
+                continue;
+            }
+            if (header.kind == static_cast<uint8_t>(SpoolKind::job))
+            {
+                // A job copied by an interrupted compaction appears twice,
+                // a digest written just before a crash may still have its
+                // events; the later record wins.
+                auto range = index.equal_range(id);
+                std::vector<Location> stale;
+                for (auto it = range.first; it != range.second; it++)
+                {
+                    stale.push_back(it->second);
+                }
+                for (const auto& loc : stale)
+                {
+                    discard(id, loc);
+                }
+                events.erase(events.lower_bound({id, 0}),
+                             events.upper_bound({id, UINT32_MAX}));
+                eventLocations.erase(
+                    eventLocations.lower_bound({id, 0}),
+                    eventLocations.upper_bound({id, UINT32_MAX}));
+                pending[id] = {id, std::move(entry.message),
+                               std::chrono::steady_clock::now()};
+            }
+            else if (pending.count(id) != 0)
+            {
+                // The digest was already written as a job
+                markDone({seq, offset, length});
+                offset += length;
+                continue;
+            }
+            else
+            {
+                // An event copied by an interrupted compaction
+                auto old = eventLocations.find(part);
+                if (old != eventLocations.end())
+                {
+                    discard(id, old->second);
+                }
+                eventLocations[part] = {seq, offset, length};
+                events[part] = std::move(entry);
+            }
+            index.emplace(id, Location{seq, offset, length});
+            segment.live++;
+            segment.liveBytes += length;
+            liveTotal += length;
+            offset += length;
+        }
+        if (offset < size)
+        {
+            std::cerr << "Mail spool segment " << seq
+                      << " has a torn record, truncating at " << offset
+                      << "\n";
+            if (ftruncate(segment.fd, static_cast<off_t>(offset)) < 0)
+            {
+                std::cerr << "Failed to truncate mail spool segment: "
+                          << strerror(errno) << "\n";
+            }
+        }
+        segment.size = offset;
+        active = seq;
+    }
+
+    for (uint32_t seq : seqs)
+    {
+        auto it = segments.find(seq);
+        if ((it != segments.end()) && (it->second.live == 0))
+        {
+            dropSegment(seq);
+        }
+    }
+    sync();
+
+    held.clear();
+    for (auto& [part, event] : events)
+    {
+        held.push_back(std::move(event));
+    }
+
+    std::vector<MailJob> jobs;
+    jobs.reserve(pending.size());
+    for (auto& [id, job] : pending)
+    {
+        jobs.push_back(std::move(job));
+    }
+    return jobs;
+}
+
+uint64_t MailSpool::reserveIds(uint64_t from, uint64_t count)
+{
+    claimedIds = std::max(claimedIds, from + count);
+    std::string path = dir + "/" + mailSpoolIdFile;
+    std::string tmpPath = path + ".tmp";
+    std::string data = std::to_string(claimedIds) + "\n";
+    int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    S_IRUSR | S_IWUSR);
+    bool written = (fd >= 0) &&
+                   (write(fd, data.data(), data.size()) ==
+                    static_cast<ssize_t>(data.size())) &&
+                   (fdatasync(fd) == 0);
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    if (!written || (rename(tmpPath.c_str(), path.c_str()) < 0))
+    {
+        // IDs stay unique for this run, only a restart may reuse them
+        std::cerr << "Failed to record mail job IDs: " << strerror(errno)
+                  << "\n";
+    }
+    return claimedIds;
+}
+
+bool MailSpool::append(const MailJob& job)
+{
+    // The old records are only released once the new one is written; the
+    // write may move them while compacting, so their locations come back
+    std::vector<Location> superseded;
+    if (!writeRecord(encodeRecord(job.id, job.message), job.id, &superseded))
+    {
+        return false;
+    }
+    release(superseded);
+    return true;
+}
+
+bool MailSpool::hold(const HeldEvent& event)
+{
+    return writeRecord(encodeRecord(event.id, event.message, &event),
+                       event.id);
+}
+
+size_t MailSpool::pendingBytes(uint64_t jobId) const
+{
+    size_t bytes = 0;
+    auto range = index.equal_range(jobId);
+    for (auto it = range.first; it != range.second; it++)
+    {
+        bytes += it->second.length;
+    }
+    return bytes;
+}
+
+bool MailSpool::writeRecord(const std::string& record, uint64_t jobId,
+                            std::vector<Location>* superseded)
+{
+    auto it = segments.find(active);
+    if ((it == segments.end()) ||
+        (it->second.size + record.size() > mailSpoolSegmentSize))
+    {
+        uint32_t sealed = active;
+        uint32_t next = active + 1;
+        if (!openSegment(next, true))
+        {
+            return false;
+        }
+        active = next;
+        seal(sealed);
+        it = segments.find(active);
+    }
+
+    Segment& segment = it->second;
+    ssize_t written = pwrite(segment.fd, record.data(), record.size(),
+                             static_cast<off_t>(segment.size));
+    if (written != static_cast<ssize_t>(record.size()))
+    {
+        std::cerr << "Failed to write mail spool record: " << strerror(errno)
+                  << "\n";
+        // Drop the partial tail so the next record starts clean
+        if (ftruncate(segment.fd, static_cast<off_t>(segment.size)) < 0)
+        {
+            std::cerr << "Failed to truncate mail spool segment: "
+                      << strerror(errno) << "\n";
+        }
+        return false;
+    }
+    if (superseded != nullptr)
+    {
+        auto range = index.equal_range(jobId);
+        for (auto old = range.first; old != range.second; old++)
+        {
+            superseded->push_back(old->second);
+        }
+        index.erase(range.first, range.second);
+    }
+    index.emplace(jobId, Location{active, segment.size, record.size()});
+    segment.size += record.size();
+    segment.live++;
+    segment.liveBytes += record.size();
+    liveTotal += record.size();
+    scheduleSync(active);
+    return true;
+}
+
+void MailSpool::remove(uint64_t jobId)
+{
+    auto range = index.equal_range(jobId);
+    std::vector<Location> locs;
+    for (auto it = range.first; it != range.second; it++)
+    {
+        locs.push_back(it->second);
+    }
+    index.erase(range.first, range.second);
+    release(locs);
+}
+
+/* Forget one record of a job, e.g. the original of a moved copy */
+void MailSpool::unindex(uint64_t jobId, const Location& loc)
+{
+    auto range = index.equal_range(jobId);
+    for (auto it = range.first; it != range.second; it++)
+    {
+        if ((it->second.segment == loc.segment) &&
+            (it->second.offset == loc.offset))
+        {
+            index.erase(it);
+            return;
+        }
+    }
+}
+
+void MailSpool::release(const std::vector<Location>& locs)
+{
+    // All records are counted out before a segment is sealed, so a
+    // compaction started by one of them does not find the others pending
+    std::set<uint32_t> touched;
+    for (const auto& loc : locs)
+    {
+        markDone(loc);
+
+        auto seg = segments.find(loc.segment);
+        if (seg == segments.end())
+        {
+            continue;
+        }
+        seg->second.live--;
+        seg->second.liveBytes -= loc.length;
+        liveTotal -= loc.length;
+        touched.insert(loc.segment);
+    }
+    for (uint32_t seq : touched)
+    {
+        if (seq != active)
+        {
+            seal(seq);
+        }
+    }
+}
+
+void MailSpool::markDone(const Location& loc)
+{
+    auto seg = segments.find(loc.segment);
+    if (seg == segments.end())
+    {
+        return;
+    }
+    uint8_t state = static_cast<uint8_t>(SpoolState::done);
+    if (pwrite(seg->second.fd, &state, sizeof(state),
+               static_cast<off_t>(loc.offset +
+                                  offsetof(SpoolRecordHeader, state))) !=
+        sizeof(state))
+    {
+        std::cerr << "Failed to mark mail spool record done: "
+                  << strerror(errno) << "\n";
+    }
+    scheduleSync(loc.segment);
+}
+
+/**
+ * seal - Reclaim a segment that no longer takes appends: delete it when
+ * nothing is pending, compact it when it is mostly done.
+ */
+void MailSpool::seal(uint32_t seq)
+{
+    auto it = segments.find(seq);
+    if (it == segments.end())
+    {
+        return;
+    }
+    if (it->second.live == 0)
+    {
+        dropSegment(seq);
+    }
+    else if ((it->second.liveBytes * 2) < it->second.size)
+    {
+        compact(seq);
+    }
+}
+
+void MailSpool::compact(uint32_t seq)
+{
+    // Copying records may roll the active segment over, which seals the
+    // old one; that must not start a compaction inside this one
+    if (compacting)
+    {
+        return;
+    }
+    compacting = true;
+    bool moved = moveRecords(seq);
+    compacting = false;
+    if (moved)
+    {
+        // The copies must be durable before the originals go away
+        sync();
+        dropSegment(seq);
+    }
+}
+
+/* Copy the pending records of seq to the active segment */
+bool MailSpool::moveRecords(uint32_t seq)
+{
+    Segment& segment = segments[seq];
+    std::vector<std::pair<uint64_t, Location>> moving;
+    for (const auto& [id, loc] : index)
+    {
+        if (loc.segment == seq)
+        {
+            moving.emplace_back(id, loc);
+        }
+    }
+    for (const auto& [id, loc] : moving)
+    {
+        std::string record(loc.length, '\0');
+        if (pread(segment.fd, record.data(), record.size(),
+                  static_cast<off_t>(loc.offset)) !=
+            static_cast<ssize_t>(record.size()))
+        {
+            std::cerr << "Failed to read mail spool record: "
+                      << strerror(errno) << "\n";
+            return false;
+        }
+        segment.live--;
+        segment.liveBytes -= loc.length;
+        liveTotal -= loc.length;
+        unindex(id, loc);
+        if (!writeRecord(record, id))
+        {
+            // Keep the original, it is still valid
+            index.emplace(id, loc);
+            segment.live++;
+            segment.liveBytes += loc.length;
+            liveTotal += loc.length;
+            return false;
+        }
+    }
+    return true;
+}
+
+void MailSpool::dropSegment(uint32_t seq)
+{
+    auto it = segments.find(seq);
+    if (it == segments.end())
+    {
+        return;
+    }
+    close(it->second.fd);
+    segments.erase(it);
+    dirtySegments.erase(seq);
+    if (seq == active)
+    {
+        // The next append starts a fresh segment
+        active++;
+    }
+    if (unlink(segmentPath(seq).c_str()) < 0)
+    {
+        std::cerr << "Failed to remove mail spool segment " << seq << ": "
+                  << strerror(errno) << "\n";
+    }
+}
+
+void MailSpool::scheduleSync(uint32_t seq)
+{
+    dirtySegments.insert(seq);
+    if (++dirty >= mailSpoolSyncBatch)
+    {
+        sync();
+        return;
+    }
+    if (syncArmed)
+    {
+        return;
+    }
+    syncArmed = true;
+    syncTimer.expires_after(mailSpoolSyncInterval);
+    syncTimer.async_wait([this](const boost::system::error_code& ec) {
+        if (ec)
+        {
+            return;
+        }
+        sync();
+    });
+}
+
+void MailSpool::sync()
+{
+    syncTimer.cancel();
+    syncArmed = false;
+    dirty = 0;
+    for (uint32_t seq : dirtySegments)
+    {
+        auto it = segments.find(seq);
+        if ((it != segments.end()) && (fdatasync(it->second.fd) < 0))
+        {
+            std::cerr << "Failed to sync mail spool segment " << seq << ": "
+                      << strerror(errno) << "\n";
+        }
+    }
+    dirtySegments.clear();
+}
+
+} // namespace manager
+} // namespace alert
+} // namespace mail
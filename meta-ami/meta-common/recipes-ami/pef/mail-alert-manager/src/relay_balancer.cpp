@@ -0,0 +1,197 @@
+#include "relay_balancer.hpp"
+
+#include <algorithm>
+#include <iostream>
+
+namespace mail
+{
+namespace alert
+{
+namespace manager
+{
+
+/* Reply of a relay that is shutting down or overloaded */
+static constexpr uint16_t smtpServiceUnavailable = 421;
+
+static bool isRelayFailure(const SmtpResult& result)
+{
+    return (result.status == smtpStatusTransportError) ||
+           (result.status == smtpStatusTimeout) ||
+           (result.status == smtpServiceUnavailable);
+}
+
+static bool sameRelay(const RelayEndpoint& a, const RelayEndpoint& b)
+{
+    return (a.host == b.host) && (a.port == b.port);
+}
+
+void RelayBalancer::configure(const std::vector<RelayEndpoint>& endpoints,
+                              RelayPolicy policy)
+{
+    std::vector<Relay> updated;
+    for (const auto& endpoint : endpoints)
+    {
+        if (endpoint.host.empty() || (endpoint.port == 0))
+        {
+            continue;
+        }
+        Relay relay;
+        if (Relay* old = find(endpoint))
+        {
+            relay = *old;
+        }
+        relay.endpoint = endpoint;
+        relay.endpoint.weight = std::max<uint16_t>(endpoint.weight, 1);
+        updated.push_back(std::move(relay));
+    }
+    relays = std::move(updated);
+    this->policy = policy;
+}
+
+RelayBalancer::Relay* RelayBalancer::find(const RelayEndpoint& endpoint)
+{
+    for (auto& relay : relays)
+    {
+        if (sameRelay(relay.endpoint, endpoint))
+        {
+            return &relay;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * candidates - Relays in the order a delivery should try them: the healthy
+ * ones first (the round-robin pick leading when enabled), then those in
+ * cool-down, soonest to recover first.
+ */
+std::vector<RelayEndpoint> RelayBalancer::candidates()
+{
+    auto now = std::chrono::steady_clock::now();
+    std::vector<Relay*> healthy;
+    std::vector<Relay*> cooling;
+    for (auto& relay : relays)
+    {
+        (relay.coolUntil <= now ? healthy : cooling).push_back(&relay);
+    }
+
+    if ((policy == RelayPolicy::weightedRoundRobin) && (healthy.size() > 1))
+    {
+        // Smooth weighted round-robin: the pick is spread out rather than
+        // sent in bursts to the heaviest relay
+        int64_t total = 0;
+        Relay* pick = nullptr;
+        for (Relay* relay : healthy)
+        {
+            relay->current += relay->endpoint.weight;
+            total += relay->endpoint.weight;
+            if ((pick == nullptr) || (relay->current > pick->current))
+            {
+                pick = relay;
+            }
+        }
+        pick->current -= total;
+        std::stable_partition(healthy.begin(), healthy.end(),
+                              [pick](Relay* relay) { return relay == pick; });
+    }
+    std::stable_sort(cooling.begin(), cooling.end(), [](Relay* a, Relay* b) {
+        return a->coolUntil < b->coolUntil;
+    });
+
+    std::vector<RelayEndpoint> order;
+    order.reserve(relays.size());
+    for (Relay* relay : healthy)
+    {
+        order.push_back(relay->endpoint);
+    }
+    for (Relay* relay : cooling)
+    {
+        order.push_back(relay->endpoint);
+    }
+    return order;
+}
+
+void RelayBalancer::send(const SmtpRelay& base, SmtpMessage&& message,
+                         SmtpClient::Callback callback)
+{
+    auto state = std::make_shared<Attempt>();
+    state->relay = base;
+    state->message = std::make_shared<const SmtpMessage>(std::move(message));
+    state->callback = std::move(callback);
+    state->order = candidates();
+    if (state->order.empty())
+    {
+        // Nothing configured, let the client report the failure
+        state->order.push_back({base.host, base.port});
+    }
+    attempt(state);
+}
+
+void RelayBalancer::attempt(const std::shared_ptr<Attempt>& state)
+{
+    const RelayEndpoint& endpoint = state->order[state->next];
+    state->relay.host = endpoint.host;
+    state->relay.port = endpoint.port;
+    client.send(state->relay, state->message,
+                [this, state](const SmtpResult& result) {
+                    bool failed = report(state->order[state->next], result);
+                    if (failed && (++state->next < state->order.size()))
+                    {
+                        const auto& next = state->order[state->next];
+                        std::cerr << "SMTP relay " << state->relay.host << ":"
+                                  << state->relay.port << " failed, trying "
+                                  << next.host << ":" << next.port << "\n";
+                        attempt(state);
+                        return;
+                    }
+                    state->callback(result);
+                });
+}
+
+/* Update the health of a relay; true when the relay itself failed */
+bool RelayBalancer::report(const RelayEndpoint& endpoint,
+                           const SmtpResult& result)
+{
+    bool failed = isRelayFailure(result);
+    Relay* relay = find(endpoint);
+    if (relay == nullptr)
+    {
+        // Removed from the configuration while the delivery was running
+        return failed;
+    }
+    if (!failed)
+    {
+        if (relay->failures >= relayFailureThreshold)
+        {
+            std::cerr << "SMTP relay " << endpoint.host << ":"
+                      << endpoint.port << " recovered\n";
+        }
+        relay->failures = 0;
+        relay->coolUntil = {};
+        return false;
+    }
+    if (++relay->failures >= relayFailureThreshold)
+    {
+        relay->coolUntil = std::chrono::steady_clock::now() + relayCooldown;
+        std::cerr << "SMTP relay " << endpoint.host << ":" << endpoint.port
+                  << " failed " << relay->failures
+                  << " times in a row, cooling down\n";
+    }
+    return true;
+}
+
+RelayHealth RelayBalancer::health() const
+{
+    auto now = std::chrono::steady_clock::now();
+    RelayHealth result;
+    for (const auto& relay : relays)
+    {
+        result.emplace_back(relay.endpoint.host, relay.endpoint.port,
+                            relay.coolUntil <= now, relay.failures);
+    }
+    return result;
+}
+
+} // namespace manager
+} // namespace alert
+} // namespace mail
@@ -0,0 +1,993 @@
+#include "smtp_client.hpp"
+
+#include <openssl/ssl.h>
+
+#include <boost/asio/connect.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/read_until.hpp>
+#include <boost/asio/ssl/host_name_verification.hpp>
+#include <boost/asio/ssl/stream.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/streambuf.hpp>
+#include <boost/asio/write.hpp>
+#include <algorithm>
+#include <ctime>
+#include <iostream>
+#include <istream>
+
+#include <unistd.h>
+
+namespace mail
+{
+namespace alert
+{
+namespace manager
+{
+
+/* Longest reply line accepted from the server */
+static constexpr size_t smtpMaxReplyLine = 4096;
+
+static std::string base64Encode(const std::string& in)
+{
+    static constexpr const char* alphabet =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    out.reserve(((in.size() + 2) / 3) * 4);
+    size_t i = 0;
+    for (; i + 2 < in.size(); i += 3)
+    {
+        uint32_t n = (static_cast<uint8_t>(in[i]) << 16) |
+                     (static_cast<uint8_t>(in[i + 1]) << 8) |
+                     static_cast<uint8_t>(in[i + 2]);
+        out += alphabet[(n >> 18) & 0x3f];
+        out += alphabet[(n >> 12) & 0x3f];
+        out += alphabet[(n >> 6) & 0x3f];
+        out += alphabet[n & 0x3f];
+    }
+    if (i < in.size())
+    {
+        uint32_t n = static_cast<uint8_t>(in[i]) << 16;
+        if (i + 1 < in.size())
+        {
+            n |= static_cast<uint8_t>(in[i + 1]) << 8;
+        }
+        out += alphabet[(n >> 18) & 0x3f];
+        out += alphabet[(n >> 12) & 0x3f];
+        out += (i + 1 < in.size()) ? alphabet[(n >> 6) & 0x3f] : '=';
+        out += '=';
+    }
+    return out;
+}
+
+std::string toHeader(const std::vector<std::string>& recipients)
+{
+    if (recipients.size() == 1)
+    {
+        return headerValue(recipients[0]);
+    }
+    return "undisclosed-recipients:;";
+}
+
+std::string headerValue(const std::string& value)
+{
+    std::string out;
+    out.reserve(value.size());
+    for (char c : value)
+    {
+        if ((c != '\r') && (c != '\n'))
+        {
+            out += c;
+        }
+    }
+    return out;
+}
+
+bool validAddress(const std::string& address)
+{
+    return address.find_first_of("\r\n<>") == std::string::npos;
+}
+
+/**
+ * messageId - A unique Message-ID: the send time, a per-process counter
+ * and the process ID, at the domain of the sender address.
+ */
+static std::string messageId(const std::string& sender, std::time_t now)
+{
+    static uint32_t sequence = 0;
+    auto at = sender.rfind('@');
+    std::string domain = (at != std::string::npos) ? sender.substr(at + 1)
+                                                   : std::string("localhost");
+    return "<" + std::to_string(now) + "." + std::to_string(++sequence) +
+           "." + std::to_string(getpid()) + "@" + headerValue(domain) + ">";
+}
+
+/**
+ * formatMessage - RFC 5322 headers plus the body with CRLF line endings
+ * and dot stuffing, terminated by the end-of-data line.
+ */
+static std::string formatMessage(const SmtpRelay& relay,
+                                 const SmtpMessage& message)
+{
+    char date[64] = {};
+    std::time_t now = std::time(nullptr);
+    struct tm tmNow;
+    localtime_r(&now, &tmNow);
+    std::strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S %z", &tmNow);
+
+    std::string data;
+    data.reserve(message.body.size() + message.subject.size() + 256);
+    data += "Date: ";
+    data += date;
+    data += "\r\nFrom: " + headerValue(relay.sender);
+    data += "\r\nTo: " + toHeader(message.recipients);
+    data += "\r\nSubject: " + headerValue(message.subject);
+    data += "\r\nMessage-ID: " + messageId(relay.sender, now) + "\r\n\r\n";
+
+    bool lineStart = true;
+    for (size_t i = 0; i < message.body.size(); i++)
+    {
+        char c = message.body[i];
+        if (lineStart && (c == '.'))
+        {
+            data += '.';
+        }
+        if (c == '\n' && ((i == 0) || (message.body[i - 1] != '\r')))
+        {
+            data += '\r';
+        }
+        data += c;
+        lineStart = (c == '\n');
+    }
+    if (!lineStart)
+    {
+        data += "\r\n";
+    }
+    data += ".\r\n";
+    return data;
+}
+
+/**
+ * SmtpConnection - One authenticated connection to a relay. open() runs
+ * the session setup (connect, greeting, EHLO, STARTTLS, AUTH); deliver()
+ * then runs any number of mail transactions on it, separated by RSET. When
+ * the server offers PIPELINING, RSET, MAIL, all RCPTs and DATA are sent in
+ * one write and their replies are read back in order. Each state waits for
+ * its reply under a phase timeout; the connection keeps itself alive
+ * through the pending handlers.
+ */
+class SmtpConnection : public std::enable_shared_from_this<SmtpConnection>
+{
+  public:
+    using Duration = std::chrono::steady_clock::duration;
+    using State = void (SmtpConnection::*)();
+    using OpenHandler = std::function<void(uint16_t status)>;
+    /* stale is set when a reused connection broke before any reply */
+    using DeliverHandler =
+        std::function<void(const SmtpResult& result, bool stale)>;
+
+    SmtpConnection(boost::asio::io_service& io, TlsContext& tls,
+                   const SmtpRelay& relay) :
+        stream(io, tls.context()),
+        timer(io), buffer(smtpMaxReplyLine), relay(relay), tlsContext(tls),
+        sessionKey(relay.host + ":" + std::to_string(relay.port))
+    {}
+
+    void open(const SmtpClient::Resolver& resolver, OpenHandler handler)
+    {
+        openHandler = std::move(handler);
+        phase = Phase::opening;
+        armTimer(smtpConnectTimeout);
+        boost::system::error_code ec;
+        auto address = boost::asio::ip::make_address(relay.host, ec);
+        if (!ec)
+        {
+            connect({boost::asio::ip::tcp::endpoint(address, relay.port)});
+            return;
+        }
+        if (!resolver)
+        {
+            boost::asio::post(timer.get_executor(),
+                              [self = shared_from_this()]() {
+                                  self->fail(
+                                      "resolve",
+                                      boost::asio::error::host_not_found);
+                              });
+            return;
+        }
+        auto onResolved = [self = shared_from_this()](
+                              const boost::system::error_code& ec,
+                              SmtpClient::Endpoints&& endpoints) {
+            if (self->phase != Phase::opening)
+            {
+                return;
+            }
+            if (ec || endpoints.empty())
+            {
+                self->fail("resolve",
+                           ec ? ec : boost::asio::error::host_not_found);
+                return;
+            }
+            self->connect(endpoints);
+        };
+        resolver(relay.host, relay.port, std::move(onResolved));
+    }
+
+    void deliver(std::shared_ptr<const SmtpMessage> msg,
+                 DeliverHandler handler)
+    {
+        phase = Phase::transaction;
+        message = std::move(msg);
+        deliverHandler = std::move(handler);
+        result = SmtpResult();
+        accepted = 0;
+        mailStatus = 0;
+        lastRejection = 0;
+        repliesSeen = 0;
+        commands.clear();
+        if (transactions++ > 0)
+        {
+            commands.push_back({Command::rset, "RSET\r\n"});
+        }
+        commands.push_back(
+            {Command::mail, "MAIL FROM:<" + relay.sender + ">\r\n"});
+        for (const auto& rcpt : message->recipients)
+        {
+            commands.push_back({Command::rcpt, "RCPT TO:<" + rcpt + ">\r\n"});
+        }
+        commands.push_back({Command::data, "DATA\r\n"});
+
+        nextReply = 0;
+        if (pipelining)
+        {
+            std::string group;
+            for (const auto& [kind, line] : commands)
+            {
+                group += line;
+            }
+            transact(std::move(group), smtpReplyTimeout,
+                     &SmtpConnection::onTransactionReply);
+            return;
+        }
+        transact(std::string(commands[0].second), smtpReplyTimeout,
+                 &SmtpConnection::onTransactionReply);
+    }
+
+    /**
+     * reusable - The connection is idle and below the per-connection
+     * message limit.
+     */
+    bool reusable() const
+    {
+        return (phase == Phase::idle) && (transactions < smtpPoolMaxMessages);
+    }
+
+    /**
+     * idle - Park the connection. onExpired runs and the connection is
+     * closed with QUIT unless deliver() is called within the timeout.
+     */
+    void idle(Duration timeout, std::function<void()> onExpired)
+    {
+        uint32_t generation = ++timerGeneration;
+        timer.expires_after(timeout);
+        timer.async_wait([self = shared_from_this(), generation,
+                          onExpired](const boost::system::error_code& ec) {
+            if (ec || (generation != self->timerGeneration) ||
+                (self->phase != Phase::idle))
+            {
+                return;
+            }
+            onExpired();
+            self->quit();
+        });
+    }
+
+    void quit()
+    {
+        if (phase != Phase::idle)
+        {
+            close();
+            return;
+        }
+        phase = Phase::quitting;
+        transact("QUIT\r\n", smtpReplyTimeout, &SmtpConnection::close);
+    }
+
+  private:
+    enum class Phase
+    {
+        opening,
+        idle,
+        transaction,
+        quitting,
+        closed,
+    };
+
+    enum class Command
+    {
+        rset,
+        mail,
+        rcpt,
+        data,
+    };
+
+    void connect(const SmtpClient::Endpoints& endpoints)
+    {
+        boost::asio::async_connect(
+            stream.next_layer(), endpoints,
+            [self = shared_from_this()](const boost::system::error_code& ec,
+                                        const boost::asio::ip::tcp::endpoint&) {
+                if (ec)
+                {
+                    self->fail("connect", ec);
+                    return;
+                }
+                // Commands are small and latency bound
+                boost::system::error_code ignore;
+                self->stream.next_layer().set_option(
+                    boost::asio::ip::tcp::no_delay(true), ignore);
+                self->readReply(smtpReplyTimeout, &SmtpConnection::onGreeting);
+            });
+    }
+
+    void onGreeting()
+    {
+        if (expect(220))
+        {
+            sendEhlo();
+        }
+    }
+
+    void sendEhlo()
+    {
+        transact("EHLO " + localName() + "\r\n", smtpReplyTimeout,
+                 &SmtpConnection::onEhlo);
+    }
+
+    void onEhlo()
+    {
+        if (!expect(250))
+        {
+            return;
+        }
+        hasStartTls = false;
+        pipelining = false;
+        authPlain = false;
+        authLogin = false;
+        for (size_t i = 1; i < replyLines.size(); i++)
+        {
+            const std::string& line = replyLines[i];
+            std::string ext = (line.size() > 4) ? line.substr(4) : "";
+            for (auto& c : ext)
+            {
+                c = static_cast<char>(toupper(c));
+            }
+            if (ext == "STARTTLS")
+            {
+                hasStartTls = true;
+            }
+            else if (ext == "PIPELINING")
+            {
+                pipelining = true;
+            }
+            else if (ext.rfind("AUTH", 0) == 0)
+            {
+                authPlain = authPlain || (ext.find(" PLAIN") != ext.npos);
+                authLogin = authLogin || (ext.find(" LOGIN") != ext.npos);
+            }
+        }
+
+        if (!tls && (relay.startTls != StartTls::disabled))
+        {
+            if (hasStartTls)
+            {
+                transact("STARTTLS\r\n", smtpReplyTimeout,
+                         &SmtpConnection::onStartTls);
+                return;
+            }
+            if (relay.startTls == StartTls::required)
+            {
+                std::cerr << "SMTP server " << relay.host
+                          << " does not offer STARTTLS\n";
+                finishOpen(smtpStatusTransportError);
+                return;
+            }
+        }
+        startAuth();
+    }
+
+    void onStartTls()
+    {
+        if (!expect(220))
+        {
+            return;
+        }
+        if (buffer.size() != 0)
+        {
+            // Plaintext sent after the 220 would be taken as a reply from
+            // inside the TLS session (CVE-2011-0411 style injection)
+            std::cerr << "SMTP server " << relay.host
+                      << " sent data after the STARTTLS reply\n";
+            fail("STARTTLS", boost::asio::error::invalid_argument);
+            return;
+        }
+        SSL_set_tlsext_host_name(stream.native_handle(), relay.host.c_str());
+        stream.set_verify_mode(boost::asio::ssl::verify_peer);
+        bool required = (relay.startTls == StartTls::required);
+        stream.set_verify_callback(
+            [host = relay.host, required](
+                bool preverified, boost::asio::ssl::verify_context& vctx) {
+                boost::asio::ssl::host_name_verification verify(host);
+                if (verify(preverified, vctx))
+                {
+                    return true;
+                }
+                X509_STORE_CTX* store = vctx.native_handle();
+                if (X509_STORE_CTX_get_error(store) == X509_V_OK)
+                {
+                    // Keep the failure in the verify result, which also
+                    // travels with the session when it is resumed
+                    X509_STORE_CTX_set_error(store,
+                                             X509_V_ERR_HOSTNAME_MISMATCH);
+                }
+                std::cerr << "SMTP server " << host
+                          << " certificate not trusted at depth "
+                          << X509_STORE_CTX_get_error_depth(store) << ": "
+                          << X509_verify_cert_error_string(
+                                 X509_STORE_CTX_get_error(store))
+                          << (required ? "\n" : ", continuing\n");
+                return !required;
+            });
+        tlsContext.prepare(stream.native_handle(), sessionKey);
+        armTimer(smtpReplyTimeout);
+        auto started = std::chrono::steady_clock::now();
+        stream.async_handshake(
+            boost::asio::ssl::stream_base::client,
+            [self = shared_from_this(),
+             started](const boost::system::error_code& ec) {
+                if (ec)
+                {
+                    self->fail("TLS handshake", ec);
+                    return;
+                }
+                self->tlsContext.recordHandshake(
+                    self->stream.native_handle(),
+                    std::chrono::steady_clock::now() - started);
+                self->tls = true;
+                self->trusted =
+                    (SSL_get_verify_result(self->stream.native_handle()) ==
+                     X509_V_OK);
+                // Extensions must be queried again over the secure channel
+                self->sendEhlo();
+            });
+    }
+
+    void startAuth()
+    {
+        if (relay.username.empty())
+        {
+            finishOpen(smtpStatusOk);
+            return;
+        }
+        if (!tls)
+        {
+            std::cerr << "SMTP server " << relay.host
+                      << " not using TLS, credentials not sent\n";
+            finishOpen(smtpStatusTransportError);
+            return;
+        }
+        if (!trusted)
+        {
+            // StartTLS "Enabled" went on past a failed verification, the
+            // peer may be anyone
+            std::cerr << "SMTP server " << relay.host
+                      << " certificate not trusted, credentials not sent\n";
+            finishOpen(smtpStatusTransportError);
+            return;
+        }
+        if (authPlain)
+        {
+            std::string token;
+            token += '\0';
+            token += relay.username;
+            token += '\0';
+            token += relay.password;
+            transact("AUTH PLAIN " + base64Encode(token) + "\r\n",
+                     smtpReplyTimeout, &SmtpConnection::onAuthDone);
+        }
+        else if (authLogin)
+        {
+            transact("AUTH LOGIN\r\n", smtpReplyTimeout,
+                     &SmtpConnection::onAuthLoginUser);
+        }
+        else
+        {
+            std::cerr << "SMTP server " << relay.host
+                      << " offers no supported AUTH mechanism\n";
+            finishOpen(smtpStatusTransportError);
+        }
+    }
+
+    void onAuthLoginUser()
+    {
+        if (expect(334))
+        {
+            transact(base64Encode(relay.username) + "\r\n", smtpReplyTimeout,
+                     &SmtpConnection::onAuthLoginPassword);
+        }
+    }
+
+    void onAuthLoginPassword()
+    {
+        if (expect(334))
+        {
+            transact(base64Encode(relay.password) + "\r\n", smtpReplyTimeout,
+                     &SmtpConnection::onAuthDone);
+        }
+    }
+
+    void onAuthDone()
+    {
+        if (expect(235))
+        {
+            finishOpen(smtpStatusOk);
+        }
+    }
+
+    /**
+     * onTransactionReply - Consume the reply of the oldest outstanding
+     * transaction command. Without pipelining the next command is only
+     * sent once its predecessor succeeded.
+     */
+    void onTransactionReply()
+    {
+        repliesSeen++;
+        Command kind = commands[nextReply++].first;
+        switch (kind)
+        {
+            case Command::rset:
+                if (replyCode != 250)
+                {
+                    // The relay gave up on the idle connection
+                    std::cerr << "SMTP server " << relay.host
+                              << " rejected RSET: " << replyCode << "\n";
+                    repliesSeen = 0;
+                    fail("reset", boost::asio::error::connection_reset);
+                    return;
+                }
+                break;
+            case Command::mail:
+                if (replyCode != 250)
+                {
+                    std::cerr << "SMTP server " << relay.host
+                              << " rejected sender: " << replyCode << "\n";
+                    mailStatus = replyCode;
+                }
+                break;
+            case Command::rcpt:
+                result.rcptStatus.push_back(replyCode);
+                if ((replyCode == 250) || (replyCode == 251))
+                {
+                    accepted++;
+                }
+                else
+                {
+                    std::cerr
+                        << "SMTP recipient "
+                        << message->recipients[result.rcptStatus.size() - 1]
+                        << " rejected: " << replyCode << "\n";
+                    lastRejection = replyCode;
+                }
+                break;
+            case Command::data:
+                onDataReply();
+                return;
+        }
+
+        if (pipelining)
+        {
+            readReply(smtpReplyTimeout, &SmtpConnection::onTransactionReply);
+            return;
+        }
+        if (mailStatus != 0)
+        {
+            finishTransaction(mailStatus);
+            return;
+        }
+        if ((commands[nextReply].first == Command::data) && (accepted == 0))
+        {
+            finishTransaction(lastRejection);
+            return;
+        }
+        transact(std::string(commands[nextReply].second), smtpReplyTimeout,
+                 &SmtpConnection::onTransactionReply);
+    }
+
+    void onDataReply()
+    {
+        bool rejected = (mailStatus != 0) || (accepted == 0);
+        if (replyCode != 354)
+        {
+            finishTransaction((mailStatus != 0) ? mailStatus
+                              : (accepted == 0) ? lastRejection
+                                                : replyCode);
+            return;
+        }
+        if (rejected)
+        {
+            // A pipelined DATA may be accepted although every recipient
+            // failed; an empty message ends it without delivering anything.
+            transact(".\r\n", smtpReplyTimeout, &SmtpConnection::onEmptyData);
+            return;
+        }
+        transact(formatMessage(relay, *message), smtpDataTimeout,
+                 &SmtpConnection::onDataDone);
+    }
+
+    void onEmptyData()
+    {
+        finishTransaction((mailStatus != 0) ? mailStatus : lastRejection);
+    }
+
+    void onDataDone()
+    {
+        finishTransaction((replyCode == 250) ? smtpStatusOk : replyCode);
+    }
+
+    /**
+     * expect - Check the reply code of a setup state. A negative reply
+     * fails the open with that code.
+     */
+    bool expect(uint16_t code)
+    {
+        if (replyCode == code)
+        {
+            return true;
+        }
+        std::cerr << "SMTP server " << relay.host << " replied " << replyCode
+                  << " (expected " << code << ")";
+        if (!replyLines.empty())
+        {
+            std::cerr << ": " << replyLines.back();
+        }
+        std::cerr << "\n";
+        finishOpen(replyCode);
+        return false;
+    }
+
+    void transact(std::string&& command, Duration timeout, State next)
+    {
+        outbound = std::move(command);
+        armTimer(timeout);
+        auto onWritten = [self = shared_from_this(), timeout,
+                          next](const boost::system::error_code& ec, size_t) {
+            if (ec)
+            {
+                self->fail("write", ec);
+                return;
+            }
+            self->readReply(timeout, next);
+        };
+        if (tls)
+        {
+            boost::asio::async_write(stream, boost::asio::buffer(outbound),
+                                     std::move(onWritten));
+        }
+        else
+        {
+            boost::asio::async_write(stream.next_layer(),
+                                     boost::asio::buffer(outbound),
+                                     std::move(onWritten));
+        }
+    }
+
+    void readReply(Duration timeout, State next)
+    {
+        replyLines.clear();
+        armTimer(timeout);
+        readLine(next);
+    }
+
+    void readLine(State next)
+    {
+        auto onLine = [self = shared_from_this(),
+                       next](const boost::system::error_code& ec, size_t) {
+            if (ec)
+            {
+                self->fail("read", ec);
+                return;
+            }
+            std::istream in(&self->buffer);
+            std::string line;
+            std::getline(in, line);
+            if (!line.empty() && (line.back() == '\r'))
+            {
+                line.pop_back();
+            }
+            if ((line.size() < 3) || !isdigit(line[0]) || !isdigit(line[1]) ||
+                !isdigit(line[2]))
+            {
+                std::cerr << "SMTP server " << self->relay.host
+                          << " sent a malformed reply\n";
+                self->fail("read", boost::asio::error::invalid_argument);
+                return;
+            }
+            self->replyLines.push_back(line);
+            if ((line.size() > 3) && (line[3] == '-'))
+            {
+                self->readLine(next);
+                return;
+            }
+            self->replyCode =
+                static_cast<uint16_t>(std::stoi(line.substr(0, 3)));
+            ((*self).*next)();
+        };
+        if (tls)
+        {
+            boost::asio::async_read_until(stream, buffer, "\r\n",
+                                          std::move(onLine));
+        }
+        else
+        {
+            boost::asio::async_read_until(stream.next_layer(), buffer, "\r\n",
+                                          std::move(onLine));
+        }
+    }
+
+    /**
+     * armTimer - Start the timeout of the next phase. A generation count
+     * keeps an expiry that raced with re-arming from closing the socket.
+     */
+    void armTimer(Duration timeout)
+    {
+        uint32_t generation = ++timerGeneration;
+        timer.expires_after(timeout);
+        timer.async_wait([self = shared_from_this(),
+                          generation](const boost::system::error_code& ec) {
+            if (ec || (generation != self->timerGeneration) ||
+                (self->phase == Phase::idle) || (self->phase == Phase::closed))
+            {
+                return;
+            }
+            // Pending socket operations complete with operation_aborted
+            // once the connection is closed and are ignored
+            self->timedOut = true;
+            self->fail("session", boost::asio::error::timed_out);
+        });
+    }
+
+    void finishOpen(uint16_t status)
+    {
+        if (status != smtpStatusOk)
+        {
+            close();
+        }
+        else
+        {
+            phase = Phase::idle;
+            stopTimer();
+        }
+        OpenHandler handler = std::move(openHandler);
+        openHandler = nullptr;
+        handler(status);
+    }
+
+    void finishTransaction(uint16_t status)
+    {
+        phase = Phase::idle;
+        stopTimer();
+        result.status = status;
+        DeliverHandler handler = std::move(deliverHandler);
+        deliverHandler = nullptr;
+        handler(result, false);
+    }
+
+    void fail(const char* what, const boost::system::error_code& ec)
+    {
+        Phase failed = phase;
+        if ((failed == Phase::closed) || (failed == Phase::idle))
+        {
+            return;
+        }
+        if (failed == Phase::quitting)
+        {
+            close();
+            return;
+        }
+        std::cerr << "SMTP " << what << " with " << relay.host << ":"
+                  << relay.port << " failed: "
+                  << (timedOut ? "timeout" : ec.message()) << "\n";
+        uint16_t status =
+            timedOut ? smtpStatusTimeout : smtpStatusTransportError;
+        if (failed == Phase::opening)
+        {
+            finishOpen(status);
+            return;
+        }
+        close();
+        result.status = status;
+        DeliverHandler handler = std::move(deliverHandler);
+        deliverHandler = nullptr;
+        handler(result, (transactions > 1) && (repliesSeen == 0));
+    }
+
+    void stopTimer()
+    {
+        ++timerGeneration;
+        timer.cancel();
+    }
+
+    void close()
+    {
+        phase = Phase::closed;
+        stopTimer();
+        boost::system::error_code ignore;
+        stream.next_layer().close(ignore);
+    }
+
+    std::string localName() const
+    {
+        char name[256] = {};
+        if ((gethostname(name, sizeof(name) - 1) != 0) || (name[0] == '\0'))
+        {
+            return "localhost";
+        }
+        return name;
+    }
+
+    boost::asio::ssl::stream<boost::asio::ip::tcp::socket> stream;
+    boost::asio::steady_timer timer;
+    boost::asio::streambuf buffer;
+    SmtpRelay relay;
+    TlsContext& tlsContext;
+    /* Relay identity the TLS session is cached under */
+    std::string sessionKey;
+    Phase phase = Phase::opening;
+    OpenHandler openHandler;
+    DeliverHandler deliverHandler;
+    std::shared_ptr<const SmtpMessage> message;
+    std::vector<std::pair<Command, std::string>> commands;
+    SmtpResult result;
+    std::string outbound;
+    std::vector<std::string> replyLines;
+    uint16_t replyCode = 0;
+    uint16_t mailStatus = 0;
+    uint16_t lastRejection = 0;
+    size_t accepted = 0;
+    size_t nextReply = 0;
+    size_t repliesSeen = 0;
+    uint32_t transactions = 0;
+    uint32_t timerGeneration = 0;
+    bool tls = false;
+    /* The relay certificate passed verification */
+    bool trusted = false;
+    bool hasStartTls = false;
+    bool pipelining = false;
+    bool authPlain = false;
+    bool authLogin = false;
+    bool timedOut = false;
+};
+
+SmtpClient::SmtpClient(boost::asio::io_service& io, TlsContext& tls) :
+    io(io), tls(tls)
+{}
+
+void SmtpClient::send(const SmtpRelay& relay, SmtpMessage&& message,
+                      Callback callback)
+{
+    send(relay, std::make_shared<const SmtpMessage>(std::move(message)),
+         std::move(callback));
+}
+
+void SmtpClient::send(const SmtpRelay& relay,
+                      std::shared_ptr<const SmtpMessage> message,
+                      Callback callback)
+{
+    if (message->recipients.empty())
+    {
+        SmtpResult result;
+        io.post([callback, result]() { callback(result); });
+        return;
+    }
+    std::string key = relay.host + ":" + std::to_string(relay.port) + ":" +
+                      relay.username + ":" +
+                      std::to_string(static_cast<int>(relay.startTls));
+    pools[key].waiting.push_back(
+        {relay, std::move(message), std::move(callback)});
+    pump(key);
+}
+
+void SmtpClient::pump(const std::string& key)
+{
+    RelayPool& pool = pools[key];
+    while (!pool.waiting.empty())
+    {
+        if (!pool.idle.empty())
+        {
+            auto conn = pool.idle.back();
+            pool.idle.pop_back();
+            Pending pending = std::move(pool.waiting.front());
+            pool.waiting.pop_front();
+            run(key, conn, std::move(pending));
+            continue;
+        }
+        if (pool.open >= maxConnections)
+        {
+            break;
+        }
+        pool.open++;
+        auto pending =
+            std::make_shared<Pending>(std::move(pool.waiting.front()));
+        pool.waiting.pop_front();
+        auto conn =
+            std::make_shared<SmtpConnection>(io, tls, pending->relay);
+        conn->open(resolver, [this, key, conn, pending](uint16_t status) {
+            if (status != smtpStatusOk)
+            {
+                pools[key].open--;
+                SmtpResult result;
+                result.status = status;
+                pending->callback(result);
+                pump(key);
+                return;
+            }
+            run(key, conn, std::move(*pending));
+        });
+    }
+}
+
+void SmtpClient::run(const std::string& key,
+                     const std::shared_ptr<SmtpConnection>& conn,
+                     Pending&& pending)
+{
+    auto shared = std::make_shared<Pending>(std::move(pending));
+    conn->deliver(shared->message, [this, key, conn, shared](
+                                       const SmtpResult& result, bool stale) {
+        if (stale && !shared->retried)
+        {
+            // The relay dropped the pooled connection while it was idle,
+            // resend on a fresh one
+            pools[key].open--;
+            shared->retried = true;
+            pools[key].waiting.push_front(std::move(*shared));
+            pump(key);
+            return;
+        }
+        // The connection may start its next transaction right away
+        SmtpResult done = result;
+        release(key, conn);
+        shared->callback(done);
+    });
+}
+
+void SmtpClient::release(const std::string& key,
+                         const std::shared_ptr<SmtpConnection>& conn)
+{
+    RelayPool& pool = pools[key];
+    if (!conn->reusable())
+    {
+        pool.open--;
+        conn->quit();
+    }
+    else
+    {
+        pool.idle.push_back(conn);
+        SmtpConnection* idleConn = conn.get();
+        conn->idle(smtpPoolIdleTimeout, [this, key, idleConn]() {
+            RelayPool& pool = pools[key];
+            auto it = std::find_if(
+                pool.idle.begin(), pool.idle.end(),
+                [idleConn](const auto& c) { return c.get() == idleConn; });
+            if (it != pool.idle.end())
+            {
+                pool.idle.erase(it);
+                pool.open--;
+            }
+        });
+    }
+    pump(key);
+}
+
+} // namespace manager
+} // namespace alert
+} // namespace mail
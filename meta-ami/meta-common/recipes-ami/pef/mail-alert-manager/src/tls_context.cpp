@@ -0,0 +1,108 @@
+#include "tls_context.hpp"
+
+#include <openssl/ssl.h>
+
+#include <iostream>
+
+namespace mail
+{
+namespace alert
+{
+namespace manager
+{
+
+/* ex_data slots linking an SSL_CTX to its TlsContext and an SSL to its key */
+static int contextIndex()
+{
+    static int index =
+        SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+}
+
+static int keyIndex()
+{
+    static int index =
+        SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+}
+
+TlsContext::TlsContext() : ctx(boost::asio::ssl::context::tls_client)
+{
+    boost::system::error_code ec;
+    ctx.set_default_verify_paths(ec);
+    if (ec)
+    {
+        std::cerr << "Failed to load the CA store: " << ec.message() << "\n";
+    }
+    // Peers are verified per connection, see SmtpConnection::onStartTls.
+    // The libesmtp engine shares this context and reports invalid
+    // certificates through its event callback instead.
+    ctx.set_verify_mode(boost::asio::ssl::verify_none);
+
+    SSL_CTX* handle = ctx.native_handle();
+    SSL_CTX_set_ex_data(handle, contextIndex(), this);
+    SSL_CTX_set_session_cache_mode(handle, SSL_SESS_CACHE_CLIENT |
+                                               SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(handle, onNewSession);
+}
+
+TlsContext::~TlsContext()
+{
+    SSL_CTX_sess_set_new_cb(ctx.native_handle(), nullptr);
+    for (auto& [key, session] : sessions)
+    {
+        SSL_SESSION_free(session);
+    }
+}
+
+void TlsContext::prepare(SSL* ssl, const std::string& key)
+{
+    SSL_set_ex_data(ssl, keyIndex(), const_cast<std::string*>(&key));
+    auto it = sessions.find(key);
+    if (it != sessions.end())
+    {
+        SSL_set_session(ssl, it->second);
+    }
+}
+
+/* Called by OpenSSL for every new session or TLS 1.3 ticket received */
+int TlsContext::onNewSession(SSL* ssl, SSL_SESSION* session)
+{
+    auto* self = static_cast<TlsContext*>(
+        SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), contextIndex()));
+    auto* key = static_cast<std::string*>(SSL_get_ex_data(ssl, keyIndex()));
+    if ((self == nullptr) || (key == nullptr))
+    {
+        return 0;
+    }
+    SSL_SESSION*& slot = self->sessions[*key];
+    if (slot != nullptr)
+    {
+        SSL_SESSION_free(slot);
+    }
+    // Returning 1 keeps the reference OpenSSL handed over
+    slot = session;
+    return 1;
+}
+
+void TlsContext::recordHandshake(SSL* ssl,
+                                 std::chrono::steady_clock::duration took)
+{
+    handshakes++;
+    if (SSL_session_reused(ssl))
+    {
+        resumed++;
+    }
+    handshakeMicros += static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(took).count());
+}
+
+TlsStats TlsContext::stats() const
+{
+    return {handshakes, resumed,
+            (handshakes == 0) ? 0 : (handshakeMicros / handshakes)};
+}
+
+} // namespace manager
+} // namespace alert
+} // namespace mail
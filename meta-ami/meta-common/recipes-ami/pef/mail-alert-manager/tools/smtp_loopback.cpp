@@ -0,0 +1,375 @@
+/**
+ * smtp-loopback - Delivery benchmark against an SMTP sink on 127.0.0.1.
+ *
+ *   smtp-loopback asio [count] [window] [connections] [--no-pipelining]
+ *     Sends count messages through the pooled SmtpClient with up to window
+ *     of them in flight and reports deliveries per second, the latency
+ *     percentiles and how many connections the pool opened.
+ *
+ *   smtp-loopback libesmtp [count]
+ *     Sends count messages one after the other through Smtp::sendmailMulti
+ *     and samples the heap in use, the RSS and the C++ allocations of the
+ *     sending thread ten times along the way. Fails if the heap grows by
+ *     more than smtpLoopbackHeapSlack after the first sample.
+ *
+ * The sink runs on its own threads with blocking sockets, so it does not
+ * share the single-threaded asio of the engines under test.
+ */
+#include "mail_alert_manager.hpp"
+
+#include <arpa/inet.h>
+#include <malloc.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace mail::alert::manager;
+
+/* Heap growth tolerated between the first and the last libesmtp sample */
+static constexpr size_t smtpLoopbackHeapSlack = 256 * 1024;
+static constexpr size_t smtpLoopbackSamples = 10;
+
+/* operator new calls made by the current thread */
+static thread_local uint64_t allocations = 0;
+
+void* operator new(std::size_t size)
+{
+    allocations++;
+    void* ptr = std::malloc((size == 0) ? 1 : size);
+    if (ptr == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+/**
+ * SmtpSink - Accepts every message. Replies are written one command at a
+ * time in the order the commands were read, which is all a pipelining
+ * client needs.
+ */
+class SmtpSink
+{
+  public:
+    explicit SmtpSink(bool pipelining) : pipelining(pipelining)
+    {}
+
+    uint16_t start()
+    {
+        listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        if ((listener < 0) ||
+            (bind(listener, reinterpret_cast<sockaddr*>(&addr), len) < 0) ||
+            (listen(listener, 64) < 0) ||
+            (getsockname(listener, reinterpret_cast<sockaddr*>(&addr),
+                         &len) < 0))
+        {
+            std::cerr << "SMTP sink: " << strerror(errno) << "\n";
+            return 0;
+        }
+        std::thread([this]() { acceptLoop(); }).detach();
+        return ntohs(addr.sin_port);
+    }
+
+    std::atomic<uint64_t> connections{0};
+    std::atomic<uint64_t> messages{0};
+
+  private:
+    void acceptLoop()
+    {
+        while (true)
+        {
+            int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0)
+            {
+                continue;
+            }
+            connections++;
+            // Replies go out one by one, Nagle would hold them back
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            std::thread([this, fd]() {
+                serve(fd);
+                close(fd);
+            }).detach();
+        }
+    }
+
+    static bool readLine(int fd, std::string& buffer, std::string& line)
+    {
+        while (true)
+        {
+            size_t end = buffer.find("\r\n");
+            if (end != std::string::npos)
+            {
+                line = buffer.substr(0, end);
+                buffer.erase(0, end + 2);
+                return true;
+            }
+            char chunk[4096];
+            ssize_t got = recv(fd, chunk, sizeof(chunk), 0);
+            if (got <= 0)
+            {
+                return false;
+            }
+            buffer.append(chunk, static_cast<size_t>(got));
+        }
+    }
+
+    static bool reply(int fd, const std::string& text)
+    {
+        return send(fd, text.data(), text.size(), MSG_NOSIGNAL) ==
+               static_cast<ssize_t>(text.size());
+    }
+
+    void serve(int fd)
+    {
+        std::string buffer;
+        std::string line;
+        if (!reply(fd, "220 loopback ESMTP\r\n"))
+        {
+            return;
+        }
+        while (readLine(fd, buffer, line))
+        {
+            std::string verb = line.substr(0, 4);
+            for (auto& c : verb)
+            {
+                c = static_cast<char>(toupper(c));
+            }
+            std::string answer = "250 OK\r\n";
+            if (verb == "EHLO")
+            {
+                answer = pipelining ? "250-loopback\r\n250-PIPELINING\r\n"
+                                      "250 8BITMIME\r\n"
+                                    : "250-loopback\r\n250 8BITMIME\r\n";
+            }
+            else if (verb == "DATA")
+            {
+                if (!reply(fd, "354 Go ahead\r\n"))
+                {
+                    return;
+                }
+                while (readLine(fd, buffer, line) && (line != "."))
+                {}
+                messages++;
+            }
+            else if (verb == "QUIT")
+            {
+                reply(fd, "221 Bye\r\n");
+                return;
+            }
+            if (!reply(fd, answer))
+            {
+                return;
+            }
+        }
+    }
+
+    bool pipelining;
+    int listener = -1;
+};
+
+static SmtpMessage testMessage(uint64_t n)
+{
+    SmtpMessage message;
+    message.recipients = {"operator@loopback"};
+    message.subject = "Loopback alert " + std::to_string(n);
+    message.body = "Event : Temperature upper critical going high\n"
+                   "Sensor : CPU0_Temp\n"
+                   "Severity : Critical\n";
+    return message;
+}
+
+static double percentile(std::vector<double>& sorted, double p)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+    size_t i = static_cast<size_t>(p * (sorted.size() - 1));
+    return sorted[i];
+}
+
+static int runAsio(uint16_t port, SmtpSink& sink, uint64_t count,
+                   uint64_t window, size_t connections)
+{
+    boost::asio::io_service io;
+    TlsContext tls;
+    SmtpClient client(io, tls);
+    client.setMaxConnections(connections);
+    SmtpRelay relay;
+    relay.host = "127.0.0.1";
+    relay.port = port;
+    relay.sender = "bmc@loopback";
+    relay.startTls = StartTls::disabled;
+
+    using Clock = std::chrono::steady_clock;
+    std::vector<double> latencies;
+    latencies.reserve(count);
+    uint64_t submitted = 0;
+    uint64_t finished = 0;
+    uint64_t failed = 0;
+    uint64_t inFlight = 0;
+    std::function<void()> fill = [&]() {
+        while ((submitted < count) && (inFlight < window))
+        {
+            inFlight++;
+            auto queued = Clock::now();
+            client.send(relay, testMessage(submitted++),
+                        [&, queued](const SmtpResult& result) {
+                            std::chrono::duration<double, std::milli> took =
+                                Clock::now() - queued;
+                            latencies.push_back(took.count());
+                            failed += (result.status != smtpStatusOk);
+                            inFlight--;
+                            if (++finished == count)
+                            {
+                                // Idle pooled connections would keep it
+                                // running until they time out
+                                io.stop();
+                                return;
+                            }
+                            fill();
+                        });
+        }
+    };
+
+    auto start = Clock::now();
+    fill();
+    io.run();
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << "messages     " << count << " (" << failed << " failed)\n"
+              << "window       " << window << ", pool " << connections
+              << "\n"
+              << "connections  " << sink.connections << "\n"
+              << "throughput   " << (count / elapsed.count()) << " msg/s\n"
+              << "latency ms   p50 " << percentile(latencies, 0.5) << "  p99 "
+              << percentile(latencies, 0.99) << "  max "
+              << (latencies.empty() ? 0 : latencies.back()) << "\n";
+    return ((failed == 0) && (sink.messages == count)) ? EXIT_SUCCESS
+                                                       : EXIT_FAILURE;
+}
+
+static size_t residentBytes()
+{
+    long pages = 0;
+    long resident = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (statm != nullptr)
+    {
+        if (fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+        {
+            resident = 0;
+        }
+        fclose(statm);
+    }
+    return static_cast<size_t>(resident) *
+           static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+static int runLibesmtp(uint16_t port, SmtpSink& sink, uint64_t count)
+{
+    Smtp smtp;
+    auth_client_init();
+    SmtpRelay relay;
+    relay.host = "127.0.0.1";
+    relay.port = port;
+    relay.sender = "bmc@loopback";
+    relay.startTls = StartTls::disabled;
+
+    uint64_t step = std::max<uint64_t>(count / smtpLoopbackSamples, 1);
+    size_t firstHeap = 0;
+    size_t lastHeap = 0;
+    uint64_t lastAllocations = allocations;
+    uint64_t failed = 0;
+    std::cout << "sends\theap KiB\tRSS KiB\tnew/send\n";
+    for (uint64_t n = 1; n <= count; n++)
+    {
+        SmtpMessage message = testMessage(n);
+        auto [status, rcpt] = smtp.sendmailMulti(
+            relay, message.recipients, message.subject, message.body);
+        failed += (status != smtpStatusOk);
+        if ((n % step) == 0)
+        {
+            lastHeap = mallinfo2().uordblks;
+            if (firstHeap == 0)
+            {
+                firstHeap = lastHeap;
+            }
+            std::cout << n << "\t" << (lastHeap / 1024) << "\t"
+                      << (residentBytes() / 1024) << "\t"
+                      << (double(allocations - lastAllocations) / step)
+                      << "\n";
+            lastAllocations = allocations;
+        }
+    }
+    auth_client_exit();
+    size_t growth = (lastHeap > firstHeap) ? (lastHeap - firstHeap) : 0;
+    std::cout << "messages   " << count << " (" << failed << " failed)\n"
+              << "heap growth after first sample " << growth << " bytes\n";
+    return ((failed == 0) && (sink.messages == count) &&
+            (growth <= smtpLoopbackHeapSlack))
+               ? EXIT_SUCCESS
+               : EXIT_FAILURE;
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<std::string> args(argv + 1, argv + argc);
+    bool pipelining = true;
+    auto flag = std::find(args.begin(), args.end(), "--no-pipelining");
+    if (flag != args.end())
+    {
+        pipelining = false;
+        args.erase(flag);
+    }
+    if (args.empty() || ((args[0] != "asio") && (args[0] != "libesmtp")))
+    {
+        std::cerr << "usage: smtp-loopback asio [count] [window] "
+                     "[connections] [--no-pipelining]\n"
+                     "       smtp-loopback libesmtp [count]\n";
+        return EXIT_FAILURE;
+    }
+    auto arg = [&args](size_t i, uint64_t fallback) {
+        return (args.size() > i) ? std::stoull(args[i]) : fallback;
+    };
+
+    SmtpSink sink(pipelining);
+    uint16_t port = sink.start();
+    if (port == 0)
+    {
+        return EXIT_FAILURE;
+    }
+    if (args[0] == "asio")
+    {
+        return runAsio(port, sink, arg(1, 10000), arg(2, 64),
+                       static_cast<size_t>(arg(3, defaultMailWorkers)));
+    }
+    return runLibesmtp(port, sink, arg(1, 100000));
+}